@@ -0,0 +1,102 @@
+// Workers hammering malloc/free and stdio while the preemption timer runs.
+//
+// Every worker shares one kernel thread, so it also shares glibc's
+// per-thread state (malloc's tcache and arena locks, stdio locks). A
+// worker preempted inside malloc or printf would let the next one
+// corrupt that state. The run fails with a heap error or a wrong check
+// if preemption is not held off inside libc.
+//
+//   ./malloc_stress [workers] [rounds]
+//
+// Output lines go to stdout; redirect it to /dev/null for a quick check.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_WORKERS 8
+#define DEFAULT_ROUNDS 1000000
+#define LIVE 64
+#define MAX_BLOCK 65536
+
+static int rounds = DEFAULT_ROUNDS;
+static long bad = 0;
+static pthread_mutex_t mutex;
+
+static void *churn(void *arg)
+{
+	int id = *(int *)arg;
+	unsigned seed = id + 1;
+	unsigned char *live[LIVE] = {0};
+	size_t size[LIVE];
+	long errors = 0;
+
+	for (int i = 0; i < rounds; i++)
+	{
+		int k = rand_r(&seed) % LIVE;
+		if (live[k])
+		{
+			/* the block must still hold what we wrote */
+			if (live[k][0] != (unsigned char)(id + k) ||
+				live[k][size[k] - 1] != (unsigned char)(id + k))
+				errors++;
+			free(live[k]);
+			live[k] = NULL;
+		}
+		else
+		{
+			size[k] = 1 + rand_r(&seed) % MAX_BLOCK;
+			live[k] = malloc(size[k]);
+			if (!live[k])
+			{
+				errors++;
+				continue;
+			}
+			/* stamp both ends, so the loop stays inside malloc and printf */
+			live[k][0] = live[k][size[k] - 1] = id + k;
+		}
+		if (i % 16 == 0)
+			printf("worker %d round %d\n", id, i);
+	}
+	for (int k = 0; k < LIVE; k++)
+		free(live[k]);
+
+	pthread_mutex_lock(&mutex);
+	bad += errors;
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : DEFAULT_WORKERS;
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	if (n <= 0 || rounds <= 0)
+	{
+		fprintf(stderr, "usage: %s [workers] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	pthread_t *thread = malloc(n * sizeof(pthread_t));
+	int *ids = malloc(n * sizeof(int));
+	pthread_mutex_init(&mutex, NULL);
+	for (int i = 0; i < n; i++)
+	{
+		ids[i] = i;
+		pthread_create(&thread[i], NULL, &churn, &ids[i]);
+	}
+	for (int i = 0; i < n; i++)
+		pthread_join(thread[i], NULL);
+	pthread_mutex_destroy(&mutex);
+
+	fprintf(stderr, "***************************\n");
+	if (bad)
+		fprintf(stderr, "malloc_stress: %ld corrupted blocks\n", bad);
+	else
+		fprintf(stderr, "malloc_stress: %d workers x %d rounds ok\n", n, rounds);
+	free(thread);
+	free(ids);
+	return bad != 0;
+}
@@ -0,0 +1,14 @@
+#!/bin/bash
+# Runs workload_mix under pthreads and then under every scheduling policy.
+# Arguments are passed to workload_mix, e.g. ./mixRun.sh -d 5 -i 400
+make workload_mix_pthread > /dev/null || exit 1
+echo "=== pthread"
+./workload_mix_pthread "$@"
+
+for SCHED in PSJF MLFQ CFS; do
+	(cd .. && make clean > /dev/null && make SCHED=$SCHED > /dev/null) || exit 1
+	rm -f workload_mix
+	make workload_mix > /dev/null || exit 1
+	echo "=== $SCHED"
+	./workload_mix "$@"
+done
@@ -0,0 +1,325 @@
+// A mixed workload for comparing the response time of the policies:
+//
+//   interactive  short CPU bursts, the latency-sensitive part
+//   hog          long CPU-bound jobs
+//   lock         many short critical sections on one shared mutex
+//   io           CPU bursts separated by blocking waits on a fake device
+//
+// Jobs of every class arrive at their own rate (Poisson arrivals) during
+// the run. For each class it prints response time (arrival to first run)
+// and turnaround time (arrival to exit) percentiles. Build it with and
+// without USE_WORKERS (make workload_mix / make workload_mix_pthread)
+// and use mixRun.sh to compare pthreads against every policy.
+//
+//   ./workload_mix [-d seconds] [-i rate] [-h rate] [-l rate] [-o rate] [-s seed]
+//
+// Rates are arrivals per second; 0 leaves a class out.
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+/* The fake I/O device is a real kernel thread even with USE_WORKERS, so
+   it is started before thread-worker.h maps pthread_* to the workers. */
+static void *io_device(void *arg);
+static int start_io_device(void)
+{
+	pthread_t tid;
+	return pthread_create(&tid, NULL, io_device, NULL);
+}
+
+#include "../thread-worker.h"
+
+#define MAX_JOBS 100000
+
+/* CPU work per job in microseconds */
+#define INTERACTIVE_US 200
+#define HOG_US 50000
+#define LOCK_ROUNDS 50
+#define LOCK_INSIDE_US 20
+#define LOCK_OUTSIDE_US 20
+#define IO_ROUNDS 3
+#define IO_CPU_US 100
+#define IO_WAIT_US 2000
+
+enum { INTERACTIVE, HOG, LOCK, IO, NUM_CLASSES };
+static const char *className[NUM_CLASSES] = {"interactive", "hog", "lock", "io"};
+static double rate[NUM_CLASSES] = {200, 5, 20, 50};
+
+typedef struct job {
+	int id;
+	int class;
+	long arrival;
+	long start;
+	long end;
+} job;
+
+static job jobs[MAX_JOBS];
+static pthread_t thread[MAX_JOBS];
+static int numJobs = 0;
+static pthread_mutex_t mutex;
+static long sharedCounter = 0;
+static double loopsPerUsec = 0;
+
+/* device requests: per job, the time its I/O completes (0 = none); the
+   last slot is the generator waiting for the next arrival */
+#define GENERATOR MAX_JOBS
+static long ioDone[MAX_JOBS + 1];
+#ifdef USE_WORKERS
+static worker_t ioWorker[MAX_JOBS + 1];
+#endif
+static volatile int stopDevice = 0;
+
+static long now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* burn roughly usec of CPU; a loop count, so preemption does not shorten it */
+static void spin(long usec)
+{
+	volatile long x = 0;
+	long loops = (long)(usec * loopsPerUsec);
+	for (long i = 0; i < loops; i++)
+		x += i;
+}
+
+static void calibrate(void)
+{
+	loopsPerUsec = 100;
+	long start = now_usec();
+	spin(100000);
+	loopsPerUsec = 100.0 * 100000 / (now_usec() - start);
+}
+
+/* complete request i if its time has come */
+static void io_complete(int i, long now)
+{
+	long done = __atomic_load_n(&ioDone[i], __ATOMIC_ACQUIRE);
+	if (done && now >= done) {
+		__atomic_store_n(&ioDone[i], 0, __ATOMIC_RELEASE);
+#ifdef USE_WORKERS
+		worker_wake(ioWorker[i]);
+#endif
+	}
+}
+
+/* complete the requests of parked io jobs and the generator; scans every 100us */
+static void *io_device(void *arg)
+{
+	struct timespec tick = {0, 100000};
+	while (!stopDevice) {
+		long now = now_usec();
+		for (int i = 0; i < numJobs; i++)
+			io_complete(i, now);
+		io_complete(GENERATOR, now);
+		nanosleep(&tick, NULL);
+	}
+	return NULL;
+}
+
+/* block for usec the way each library blocks on I/O */
+static void io_wait(job *j, long usec)
+{
+#ifdef USE_WORKERS
+	__atomic_store_n(&ioDone[j->id], now_usec() + usec, __ATOMIC_RELEASE);
+	worker_park();
+#else
+	struct timespec wait = {usec / 1000000, (usec % 1000000) * 1000};
+	nanosleep(&wait, NULL);
+#endif
+}
+
+static void *run_job(void *arg)
+{
+	job *j = arg;
+	j->start = now_usec();
+
+	switch (j->class) {
+	case INTERACTIVE:
+		spin(INTERACTIVE_US);
+		break;
+	case HOG:
+		spin(HOG_US);
+		break;
+	case LOCK:
+		for (int i = 0; i < LOCK_ROUNDS; i++) {
+			pthread_mutex_lock(&mutex);
+			spin(LOCK_INSIDE_US);
+			sharedCounter++;
+			pthread_mutex_unlock(&mutex);
+			spin(LOCK_OUTSIDE_US);
+		}
+		break;
+	case IO:
+		for (int i = 0; i < IO_ROUNDS; i++) {
+#ifdef USE_WORKERS
+			ioWorker[j->id] = worker_self();
+#endif
+			spin(IO_CPU_US);
+			io_wait(j, IO_WAIT_US);
+		}
+		break;
+	}
+
+	j->end = now_usec();
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/* wait for the next arrival without taking the CPU from the workers */
+static void wait_until(long when)
+{
+	while (now_usec() < when) {
+#ifdef USE_WORKERS
+		/* park until the device sees the arrival time pass; before the
+		   first worker there is nobody to give the CPU to, so sleep */
+		if (worker_self() != -1) {
+			ioWorker[GENERATOR] = worker_self();
+			__atomic_store_n(&ioDone[GENERATOR], when, __ATOMIC_RELEASE);
+			worker_park();
+			continue;
+		}
+#endif
+		long left = when - now_usec();
+		if (left > 0) {
+			struct timespec wait = {left / 1000000, (left % 1000000) * 1000};
+			nanosleep(&wait, NULL);
+		}
+	}
+}
+
+/* exponential inter-arrival time in usec */
+static long next_gap(double perSecond)
+{
+	double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+	return (long)(-log(u) / perSecond * 1000000);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+static long percentile(long *v, int n, int pct)
+{
+	int idx = (int)((long)n * pct / 100);
+	if (idx >= n)
+		idx = n - 1;
+	return v[idx];
+}
+
+static void report(void)
+{
+	long *resp = malloc(numJobs * sizeof(long));
+	long *turn = malloc(numJobs * sizeof(long));
+
+	printf("%-12s %6s   %-34s %-34s\n", "class", "jobs",
+	       "response p50/p90/p99/max (us)", "turnaround p50/p90/p99/max (us)");
+	for (int c = 0; c < NUM_CLASSES; c++) {
+		int n = 0;
+		for (int i = 0; i < numJobs; i++) {
+			if (jobs[i].class != c)
+				continue;
+			resp[n] = jobs[i].start - jobs[i].arrival;
+			turn[n] = jobs[i].end - jobs[i].arrival;
+			n++;
+		}
+		if (n == 0)
+			continue;
+		qsort(resp, n, sizeof(long), compare_long);
+		qsort(turn, n, sizeof(long), compare_long);
+
+		char r[64], t[64];
+		snprintf(r, sizeof(r), "%ld/%ld/%ld/%ld", percentile(resp, n, 50),
+			 percentile(resp, n, 90), percentile(resp, n, 99), resp[n - 1]);
+		snprintf(t, sizeof(t), "%ld/%ld/%ld/%ld", percentile(turn, n, 50),
+			 percentile(turn, n, 90), percentile(turn, n, 99), turn[n - 1]);
+		printf("%-12s %6d   %-34s %-34s\n", className[c], n, r, t);
+	}
+
+	free(resp);
+	free(turn);
+}
+
+int main(int argc, char **argv) {
+	double seconds = 2;
+	unsigned seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:i:h:l:o:s:")) != -1) {
+		switch (opt) {
+		case 'd': seconds = atof(optarg); break;
+		case 'i': rate[INTERACTIVE] = atof(optarg); break;
+		case 'h': rate[HOG] = atof(optarg); break;
+		case 'l': rate[LOCK] = atof(optarg); break;
+		case 'o': rate[IO] = atof(optarg); break;
+		case 's': seed = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-d seconds] [-i rate] [-h rate] [-l rate] [-o rate] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	srand(seed);
+	calibrate();
+	pthread_mutex_init(&mutex, NULL);
+	if (start_io_device() != 0) {
+		perror("io device");
+		return 1;
+	}
+
+	/* next arrival of each class */
+	long begin = now_usec();
+	long finish = begin + (long)(seconds * 1000000);
+	long next[NUM_CLASSES];
+	for (int c = 0; c < NUM_CLASSES; c++)
+		next[c] = rate[c] > 0 ? begin + next_gap(rate[c]) : -1;
+
+	for (;;) {
+		int c = -1;
+		for (int k = 0; k < NUM_CLASSES; k++) {
+			if (next[k] >= 0 && (c < 0 || next[k] < next[c]))
+				c = k;
+		}
+		if (c < 0 || next[c] >= finish || numJobs == MAX_JOBS)
+			break;
+
+		wait_until(next[c]);
+		job *j = &jobs[numJobs];
+		j->id = numJobs;
+		j->class = c;
+		j->arrival = now_usec();
+		if (pthread_create(&thread[numJobs], NULL, &run_job, j) != 0) {
+			perror("create");
+			break;
+		}
+		numJobs++;
+		next[c] += next_gap(rate[c]);
+	}
+
+	for (int i = 0; i < numJobs; i++)
+		pthread_join(thread[i], NULL);
+	stopDevice = 1;
+
+	fprintf(stderr, "***************************\n");
+	printf("Total run time: %ld milli-seconds, %d jobs\n", (now_usec() - begin) / 1000, numJobs);
+	report();
+
+	/* the mutex must have kept every increment */
+	long lockJobs = 0;
+	for (int i = 0; i < numJobs; i++)
+		lockJobs += jobs[i].class == LOCK;
+	if (sharedCounter != lockJobs * LOCK_ROUNDS)
+		printf("lock counter is %ld, expected %ld\n", sharedCounter, lockJobs * LOCK_ROUNDS);
+	pthread_mutex_destroy(&mutex);
+	return 0;
+}
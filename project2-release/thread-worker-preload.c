@@ -0,0 +1,549 @@
+// File:	thread-worker-preload.c
+// List all group member's name: Charles Eshelman, Shane Haughton
+// username of iLab: cae131
+// iLab Server: ice.cs.rutgers.edu
+
+// LD_PRELOAD shim: runs an unmodified pthread program's threads as workers.
+//
+//   make preload SCHED=PSJF
+//   LD_PRELOAD=./libthread-worker-preload.so ./program
+//
+// pthread_create/join/exit/detach/self, sched_yield, pthread_mutex_* and
+// pthread_cond_* are interposed. Everything else, robust and process-shared
+// mutexes, process-shared condition variables, and threads created from any
+// kernel thread other than the one running the workers, go to the real
+// pthread library. Worker mutexes and condition variables may still be
+// shared with those kernel threads. Set WORKER_PRELOAD_DISABLE=1 to forward
+// everything.
+//
+// Workers are preempted by the library's timer, which holds off while a
+// worker is inside libc, so threads may call malloc, printf and friends.
+//
+// Known limits:
+//  - thread-specific data (pthread_key_*) is per kernel thread, so all
+//    workers share it;
+//  - mutex priority protocols (PTHREAD_PRIO_INHERIT/PROTECT) are ignored;
+//  - a worker never sleeps in the real library, since that would stop every
+//    worker: waiting on a real mutex or condition variable it sleeps as a
+//    worker until one is unlocked or signalled in this process, checking
+//    again every REAL_POLL_US, so real condition variables wake workers
+//    spuriously and changes made by another process are seen late;
+//  - the real library sees every worker as the same thread, so a robust or
+//    process-shared mutex that is also recursive or error-checking cannot
+//    tell workers apart, and a worker exiting with a robust mutex held is
+//    not noticed;
+//  - a condition variable must be waited on with a mutex of its own kind
+//    (both handed to the real library, or neither).
+
+#include "thread-worker.h"
+#include <pthread.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+/* pthread_t values handed out for workers carry this bit; real pthread_t
+   values are user-space addresses and never do */
+#define WORKER_TAG (1UL << 63)
+#define IS_WORKER(t) (((unsigned long)(t) & WORKER_TAG) != 0)
+
+/* registry size for mutexes/conds that were handed to the real library */
+#define REAL_OBJECTS 256
+
+/* longest a worker waiting on a real mutex/cond sleeps before looking at
+   it again, in case another process changed it */
+#ifndef REAL_POLL_US
+#define REAL_POLL_US 1000
+#endif
+
+_Static_assert(sizeof(worker_mutex_t) <= sizeof(pthread_mutex_t),
+			   "worker_mutex_t must fit inside pthread_mutex_t");
+#ifdef __GLIBC__
+/* PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP and friends only set the kind */
+_Static_assert(offsetof(worker_mutex_t, type) == offsetof(pthread_mutex_t, __data.__kind),
+			   "worker_mutex_t type must overlay the glibc mutex kind");
+#endif
+
+static int (*real_create)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+static int (*real_join)(pthread_t, void **);
+static void (*real_exit)(void *) __attribute__((noreturn));
+static int (*real_detach)(pthread_t);
+static pthread_t (*real_self)(void);
+static int (*real_sched_yield)(void);
+static int (*real_mutex_init)(pthread_mutex_t *, const pthread_mutexattr_t *);
+static int (*real_mutex_lock)(pthread_mutex_t *);
+static int (*real_mutex_trylock)(pthread_mutex_t *);
+static int (*real_mutex_unlock)(pthread_mutex_t *);
+static int (*real_mutex_destroy)(pthread_mutex_t *);
+static int (*real_cond_init)(pthread_cond_t *, const pthread_condattr_t *);
+static int (*real_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+static int (*real_cond_timedwait)(pthread_cond_t *, pthread_mutex_t *, const struct timespec *);
+static int (*real_cond_signal)(pthread_cond_t *);
+static int (*real_cond_broadcast)(pthread_cond_t *);
+static int (*real_cond_destroy)(pthread_cond_t *);
+
+static int shimDisabled = 0;
+static pid_t runtimeTid = 0;
+
+/* addresses of mutexes/conds owned by the real library, and the clock of
+   each condition variable. Lock-free: a worker preempted inside a spinlock
+   here would hang every worker spinning after it. */
+static void *realObjects[REAL_OBJECTS];
+static clockid_t realClocks[REAL_OBJECTS];
+static int numRealObjects = 0;
+
+/* workers waiting on a real mutex/cond sleep on realTurn until a real
+   object is unlocked or signalled in this process (realTurnSeq moves) */
+static worker_mutex_t realTurnLock;
+static worker_cond_t realTurn;
+static unsigned int realTurnSeq = 0;
+static int realTurnWaiters = 0;
+
+#define RESOLVE(var, name)                          \
+	do                                              \
+	{                                               \
+		*(void **)(&var) = dlsym(RTLD_NEXT, name);  \
+		if (!var)                                   \
+		{                                           \
+			fprintf(stderr, "thread-worker-preload: no %s\n", name); \
+			abort();                                \
+		}                                           \
+	} while (0)
+
+__attribute__((constructor)) static void shim_init(void)
+{
+	RESOLVE(real_create, "pthread_create");
+	RESOLVE(real_join, "pthread_join");
+	RESOLVE(real_exit, "pthread_exit");
+	RESOLVE(real_detach, "pthread_detach");
+	RESOLVE(real_self, "pthread_self");
+	RESOLVE(real_sched_yield, "sched_yield");
+	RESOLVE(real_mutex_init, "pthread_mutex_init");
+	RESOLVE(real_mutex_lock, "pthread_mutex_lock");
+	RESOLVE(real_mutex_trylock, "pthread_mutex_trylock");
+	RESOLVE(real_mutex_unlock, "pthread_mutex_unlock");
+	RESOLVE(real_mutex_destroy, "pthread_mutex_destroy");
+	RESOLVE(real_cond_init, "pthread_cond_init");
+	RESOLVE(real_cond_wait, "pthread_cond_wait");
+	RESOLVE(real_cond_timedwait, "pthread_cond_timedwait");
+	RESOLVE(real_cond_signal, "pthread_cond_signal");
+	RESOLVE(real_cond_broadcast, "pthread_cond_broadcast");
+	RESOLVE(real_cond_destroy, "pthread_cond_destroy");
+
+	const char *off = getenv("WORKER_PRELOAD_DISABLE");
+	shimDisabled = off && *off && strcmp(off, "0") != 0;
+	runtimeTid = (pid_t)syscall(SYS_gettid);
+}
+
+/* workers only live on the kernel thread that loaded us */
+static int on_runtime_thread(void)
+{
+	static __thread pid_t myTid = 0;
+	if (!myTid)
+		myTid = (pid_t)syscall(SYS_gettid);
+	return !shimDisabled && myTid == runtimeTid;
+}
+
+/* is the caller a worker, which must not block the kernel thread? */
+static int on_worker(void)
+{
+	return on_runtime_thread() && worker_self() != -1;
+}
+
+static int mark_real(void *obj, clockid_t clock)
+{
+	for (int i = 0; i < REAL_OBJECTS; i++)
+	{
+		void *empty = NULL;
+		if (__atomic_compare_exchange_n(&realObjects[i], &empty, obj, 0,
+										__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		{
+			realClocks[i] = clock;
+			__atomic_add_fetch(&numRealObjects, 1, __ATOMIC_SEQ_CST);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* registry slot of obj, -1 if the workers own it */
+static int real_slot(void *obj)
+{
+	/* common case: nothing was handed to the real library */
+	if (__atomic_load_n(&numRealObjects, __ATOMIC_ACQUIRE) == 0)
+		return -1;
+
+	for (int i = 0; i < REAL_OBJECTS; i++)
+	{
+		if (__atomic_load_n(&realObjects[i], __ATOMIC_ACQUIRE) == obj)
+			return i;
+	}
+	return -1;
+}
+
+static int is_real(void *obj)
+{
+	return real_slot(obj) >= 0;
+}
+
+/* clock a real condition variable measures its deadlines on */
+static clockid_t real_clock(void *obj)
+{
+	int i = real_slot(obj);
+	return i >= 0 ? realClocks[i] : CLOCK_REALTIME;
+}
+
+static void unmark_real(void *obj)
+{
+	for (int i = 0; i < REAL_OBJECTS; i++)
+	{
+		void *expected = obj;
+		if (__atomic_compare_exchange_n(&realObjects[i], &expected, NULL, 0,
+										__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		{
+			__atomic_sub_fetch(&numRealObjects, 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+	}
+}
+
+/* condition variables the worker runtime cannot honour go to the real library */
+static int needs_real_cond(const pthread_condattr_t *attr)
+{
+	int pshared;
+	return attr && pthread_condattr_getpshared(attr, &pshared) == 0 &&
+		   pshared != PTHREAD_PROCESS_PRIVATE;
+}
+
+/* mutexes the worker runtime cannot honour go to the real library; it
+   does recursive and error-checking ones itself */
+static int needs_real_mutex(const pthread_mutexattr_t *attr)
+{
+	int pshared, robust;
+	if (!attr)
+		return 0;
+	if (pthread_mutexattr_getpshared(attr, &pshared) == 0 &&
+		pshared != PTHREAD_PROCESS_PRIVATE)
+		return 1;
+	if (pthread_mutexattr_getrobust(attr, &robust) == 0 &&
+		robust != PTHREAD_MUTEX_STALLED)
+		return 1;
+	return 0;
+}
+
+static unsigned int real_turn_seq(void)
+{
+	return __atomic_load_n(&realTurnSeq, __ATOMIC_SEQ_CST);
+}
+
+/* a real object was unlocked or signalled: wake the workers waiting on one */
+static void real_next_turn(void)
+{
+	__atomic_add_fetch(&realTurnSeq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&realTurnWaiters, __ATOMIC_SEQ_CST) == 0)
+		return;
+	worker_mutex_lock(&realTurnLock);
+	worker_cond_broadcast(&realTurn);
+	worker_mutex_unlock(&realTurnLock);
+}
+
+/* Block the calling worker until the turn moves past seq or maxNs pass.
+   Sleeping in the real library instead would stop every worker, including
+   the one that would unlock or signal. */
+static void real_wait_turn(unsigned int seq, long maxNs)
+{
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += maxNs;
+	until.tv_sec += until.tv_nsec / 1000000000L;
+	until.tv_nsec %= 1000000000L;
+
+	worker_mutex_lock(&realTurnLock);
+	__atomic_add_fetch(&realTurnWaiters, 1, __ATOMIC_SEQ_CST);
+	while (real_turn_seq() == seq &&
+		   worker_cond_timedwait(&realTurn, &realTurnLock, &until) == 0)
+		;
+	__atomic_sub_fetch(&realTurnWaiters, 1, __ATOMIC_SEQ_CST);
+	worker_mutex_unlock(&realTurnLock);
+}
+
+/* take a real mutex from a worker. The real library cannot tell workers
+   apart, so an error-checking one reports EDEADLK for someone else's hold
+   too. */
+static int real_lock_worker(pthread_mutex_t *mutex)
+{
+	for (;;)
+	{
+		unsigned int seq = real_turn_seq();
+		int ret = real_mutex_trylock(mutex);
+		if (ret != EBUSY && ret != EDEADLK)
+			return ret;
+		real_wait_turn(seq, REAL_POLL_US * 1000L);
+	}
+}
+
+/* wait on a real condition variable from a worker: sleep until something
+   in this process signals a real one, or one poll interval passes, which
+   looks like a spurious wakeup to the caller */
+static int real_cond_wait_worker(pthread_cond_t *cond, pthread_mutex_t *mutex,
+								 const struct timespec *abstime)
+{
+	long left = REAL_POLL_US * 1000L;
+	if (abstime)
+	{
+		struct timespec now;
+		clock_gettime(real_clock(cond), &now);
+		long toDeadline = (abstime->tv_sec - now.tv_sec) * 1000000000L +
+						  (abstime->tv_nsec - now.tv_nsec);
+		if (toDeadline <= 0)
+			return ETIMEDOUT;
+		if (toDeadline < left)
+			left = toDeadline;
+	}
+
+	real_mutex_unlock(mutex);
+	real_next_turn();
+	real_wait_turn(real_turn_seq(), left);
+	int ret = real_lock_worker(mutex);
+	if (ret != 0 || !abstime)
+		return ret;
+
+	struct timespec now;
+	clock_gettime(real_clock(cond), &now);
+	if (now.tv_sec > abstime->tv_sec ||
+		(now.tv_sec == abstime->tv_sec && now.tv_nsec >= abstime->tv_nsec))
+		return ETIMEDOUT;
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Threads
+// -----------------------------------------------------------------------------
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+				   void *(*start_routine)(void *), void *arg)
+{
+	if (!on_runtime_thread())
+		return real_create(thread, attr, start_routine, arg);
+
+	int detach = PTHREAD_CREATE_JOINABLE;
+	if (attr)
+		pthread_attr_getdetachstate(attr, &detach);
+
+	worker_t w;
+	if (worker_create(&w, NULL, start_routine, arg) != 0)
+		return EAGAIN;
+	if (detach == PTHREAD_CREATE_DETACHED)
+		worker_detach(w);
+
+	*thread = (pthread_t)(WORKER_TAG | (unsigned long)w);
+	return 0;
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+	if (!IS_WORKER(thread))
+		return real_join(thread, retval);
+	if (!on_runtime_thread())
+		return EINVAL;
+
+	return worker_join((worker_t)(thread & ~WORKER_TAG), retval) == 0 ? 0 : ESRCH;
+}
+
+void pthread_exit(void *retval)
+{
+	if (on_runtime_thread() && worker_self() != -1)
+		worker_exit(retval);
+	real_exit(retval);
+}
+
+int pthread_detach(pthread_t thread)
+{
+	if (!IS_WORKER(thread))
+		return real_detach(thread);
+
+	return worker_detach((worker_t)(thread & ~WORKER_TAG)) == 0 ? 0 : EINVAL;
+}
+
+pthread_t pthread_self(void)
+{
+	if (on_runtime_thread() && worker_self() != -1)
+		return (pthread_t)(WORKER_TAG | (unsigned long)worker_self());
+	return real_self();
+}
+
+int sched_yield(void)
+{
+	if (on_runtime_thread() && worker_self() != -1)
+		return worker_yield();
+	return real_sched_yield();
+}
+
+// -----------------------------------------------------------------------------
+// Mutexes
+// -----------------------------------------------------------------------------
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+	if (shimDisabled || needs_real_mutex(attr))
+	{
+		if (!shimDisabled && mark_real(mutex, CLOCK_REALTIME) != 0)
+			return ENOMEM;
+		return real_mutex_init(mutex, attr);
+	}
+
+	memset(mutex, 0, sizeof(*mutex));
+	return worker_mutex_init((worker_mutex_t *)mutex, attr) == 0 ? 0 : EINVAL;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+	if (shimDisabled)
+		return real_mutex_lock(mutex);
+	if (is_real(mutex))
+		return on_worker() ? real_lock_worker(mutex) : real_mutex_lock(mutex);
+
+	/* other kernel threads spin inside the runtime */
+	return worker_mutex_lock_at((worker_mutex_t *)mutex, __builtin_return_address(0)) == 0 ? 0 : errno;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+	if (shimDisabled || is_real(mutex))
+		return real_mutex_trylock(mutex);
+
+	return worker_mutex_trylock((worker_mutex_t *)mutex) == 0 ? 0 : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+	if (shimDisabled)
+		return real_mutex_unlock(mutex);
+	if (is_real(mutex))
+	{
+		int ret = real_mutex_unlock(mutex);
+		real_next_turn();
+		return ret;
+	}
+
+	/* from another kernel thread the runtime posts the wakeup */
+	return worker_mutex_unlock((worker_mutex_t *)mutex) == 0 ? 0 : errno;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+	if (shimDisabled)
+		return real_mutex_destroy(mutex);
+	if (is_real(mutex))
+	{
+		unmark_real(mutex);
+		return real_mutex_destroy(mutex);
+	}
+
+	return worker_mutex_destroy((worker_mutex_t *)mutex) == 0 ? 0 : EBUSY;
+}
+
+// -----------------------------------------------------------------------------
+// Condition variables
+//
+// A worker condition variable keeps its waiters on a heap, like a worker
+// mutex: a waiting worker is blocked until signal/broadcast or its deadline
+// makes it runnable. The clock attribute is honoured; process-shared
+// condition variables go to the real library.
+// -----------------------------------------------------------------------------
+
+_Static_assert(sizeof(worker_cond_t) <= sizeof(pthread_cond_t),
+			   "worker_cond_t must fit inside pthread_cond_t");
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+	if (shimDisabled || needs_real_cond(attr))
+	{
+		clockid_t clock = CLOCK_REALTIME;
+		if (attr)
+			pthread_condattr_getclock(attr, &clock);
+		if (!shimDisabled && mark_real(cond, clock) != 0)
+			return ENOMEM;
+		return real_cond_init(cond, attr);
+	}
+
+	return worker_cond_init((worker_cond_t *)cond, attr) == 0 ? 0 : EINVAL;
+}
+
+/* 0 to use the workers' wait, 1 for the real library, -1 if cond and
+   mutex belong to different ones */
+static int real_cond_pair(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	if (shimDisabled)
+		return 1;
+	int realCond = is_real(cond);
+	if (realCond != is_real(mutex))
+		return -1;
+	return realCond;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	int real = real_cond_pair(cond, mutex);
+	if (real == 1)
+		return on_worker() ? real_cond_wait_worker(cond, mutex, NULL)
+						   : real_cond_wait(cond, mutex);
+	if (real == -1)
+		return EINVAL;
+
+	return worker_cond_wait((worker_cond_t *)cond, (worker_mutex_t *)mutex) == 0 ? 0 : errno;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+						   const struct timespec *abstime)
+{
+	int real = real_cond_pair(cond, mutex);
+	if (real == 1)
+		return on_worker() ? real_cond_wait_worker(cond, mutex, abstime)
+						   : real_cond_timedwait(cond, mutex, abstime);
+	if (real == -1)
+		return EINVAL;
+
+	return worker_cond_timedwait((worker_cond_t *)cond, (worker_mutex_t *)mutex,
+								 abstime) == 0 ? 0 : errno;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+	if (shimDisabled)
+		return real_cond_signal(cond);
+	if (is_real(cond))
+	{
+		int ret = real_cond_signal(cond);
+		real_next_turn();
+		return ret;
+	}
+	return worker_cond_signal((worker_cond_t *)cond) == 0 ? 0 : ENOMEM;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+	if (shimDisabled)
+		return real_cond_broadcast(cond);
+	if (is_real(cond))
+	{
+		int ret = real_cond_broadcast(cond);
+		real_next_turn();
+		return ret;
+	}
+	return worker_cond_broadcast((worker_cond_t *)cond) == 0 ? 0 : ENOMEM;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+	if (shimDisabled)
+		return real_cond_destroy(cond);
+	if (is_real(cond))
+	{
+		unmark_real(cond);
+		return real_cond_destroy(cond);
+	}
+	return worker_cond_destroy((worker_cond_t *)cond) == 0 ? 0 : EBUSY;
+}
@@ -4,9 +4,20 @@
 // iLab Server: ice.cs.rutgers.edu
 
 #include "thread-worker.h"
+#include "worker-metrics.h"
 #include <time.h>
 #include <sys/time.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <link.h>
 
 // Global counter for total context switches and
 // average turn around and response time
@@ -16,12 +27,185 @@ double avg_resp_time = 0;
 int threadID = 0;
 ucontext_t schedCtx;
 tcb *current = NULL;
+tcb *mainTCB = NULL;
 minHeap rq;
 minHeap mlfq[NUMQUEUES]; 
+workerGroup groups[MAX_GROUPS];
+static long cfsMinVruntime = 0;
 
 // INITAILIZE ALL YOUR OTHER VARIABLES HERE
 // YOUR CODE HERE
 
+// EVERY LIVE TCB INDEXED BY tID, for worker_join/worker_detach
+static tcb **tcbTable = NULL;
+static int tcbTableSize = 0;
+
+// SCHEDULER CONTEXT STACK
+#define SCHED_STACK_SIZE (2048 * 32)
+static void *schedStack = NULL;
+
+// Set while a worker is inside the runtime (run queues, block lists), so
+// the preemption timer does not switch it out halfway through an update
+static volatile sig_atomic_t inRuntime = 0;
+// Set when the timer fired while preemption was held off; the worker gives
+// up the CPU at the next LEAVE_RUNTIME instead
+static volatile sig_atomic_t preemptPending = 0;
+
+// CODE RANGES OF libc AND ld.so: every worker shares one kernel thread and
+// so one set of malloc arenas, tcache and stdio locks, and a worker must
+// never be switched out while it is inside them
+#define MAX_LIBC_RANGES 16
+static uintptr_t libcRange[MAX_LIBC_RANGES][2];
+static int numLibcRanges = 0;
+
+// COPY-STACK MODE
+typedef struct sharedStack
+{
+	char *base;
+	tcb *owner;         /* worker whose frames are on the stack right now */
+} sharedStack;
+static sharedStack sharedStacks[MAX_SHARED_STACKS];
+static int numSharedStacks = 0;
+static int nextSharedStack = 0;
+static long tot_stack_saves = 0;
+// DIRECT SWITCHES ONTO A SHARED STACK GO THROUGH A SMALL CONTEXT OF THEIR OWN
+#define STACK_SWITCH_SIZE 16384
+static ucontext_t stackSwitchCtx;
+static void *stackSwitchStack = NULL;
+static tcb *switchTarget = NULL;
+static long tot_stack_bytes = 0;
+#define ENTER_RUNTIME() (inRuntime = 1)
+#define LEAVE_RUNTIME()          \
+	do                           \
+	{                            \
+		inRuntime = 0;           \
+		if (preemptPending)      \
+			preempt_point();     \
+	} while (0)
+
+static void preempt_point(void);
+
+static void schedule();
+static int runnable_count(void);
+static void worker_start(void);
+static int create_worker(worker_t *thread, int group, int cpu, pthread_attr_t *attr,
+						 void *(*function)(void *), void *arg);
+static void init_tcb(tcb *block, ucontext_t *tmpl, void *stack, size_t stackSize,
+					 int group, int cpu, void *(*function)(void *), void *arg);
+static void join_reap(tcb *block, void **value_ptr);
+
+// IDLE PARKING: the scheduler sleeps on idleFd when nothing is runnable
+static int idleFd = -1;
+static int idleParked = 0;       /* seq_cst, paired with the pending counts */
+static long idleTime[MAX_CORES];
+static long idleParks = 0;
+minHeap parkList;
+
+// ADAPTIVE QUANTUM: slice tuned from the measured switch cost
+long sliceUsec = QUANTUM * 1000;
+long switchCostNs = 0;
+static long swapCostNs = 0;
+long tot_preemptions = 0;
+long tot_handoffs = 0;
+long tot_wake_boosts = 0;
+long tot_global_boosts = 0;
+static long schedEnterNs = 0;
+static long quantumAdjustments = 0;
+static long quantumLog[QUANTUM_LOG_SIZE][2];
+
+// LIVE METRICS: shared memory segment read by worker-stat
+_Static_assert(NUMQUEUES <= METRICS_LEVELS, "metrics segment needs a slot per queue");
+static workerMetrics *metrics = NULL;
+static long numBlocked[NUMQUEUES];
+long tot_mutex_acquired = 0;
+long tot_mutex_contended = 0;
+
+// SAMPLING PROFILER: filled by the SIGPROF handler, folded on stop
+typedef struct profSample
+{
+    int tID;            /* -1 while the scheduler itself was running */
+    int depth;
+    void *pc[PROF_MAX_DEPTH];
+} profSample;
+
+static profSample *profSamples = NULL;
+static volatile int numProfSamples = 0;
+static volatile long profDropped = 0;
+static char *profThreadStack[2];    /* [lo, hi) of the kernel thread's own stack */
+
+// MUTEX PROFILER
+typedef struct lockSite
+{
+	void *pc;
+	long waitNs;        /* longest wait seen at this call site */
+} lockSite;
+typedef struct mutexProf
+{
+	void *mutex;
+	void *site;         /* where it was initialized, or first locked */
+	int destroyed;
+	long acquired;
+	long contended;
+	long waitNs, maxWaitNs;
+	long holdNs, maxHoldNs;
+	long acquiredAt;
+	lockSite worst[LOCK_PROF_SITES];
+	struct mutexProf *next;
+} mutexProf;
+static int lockProfOn = 0;
+static mutexProf *lockProfs = NULL;
+static mutexProf *mutex_prof(worker_mutex_t *mutex, void *site);
+static void mutex_prof_acquired(worker_mutex_t *mutex, long waitStart, void *site);
+
+// CPU PLACEMENT: topology from /sys and the CPUs the runtime may use
+typedef struct cpuTopo
+{
+	int online;
+	int core;           /* core_id, shared by SMT siblings */
+	int package;        /* physical_package_id (socket) */
+	int llc;            /* id of the last-level cache */
+} cpuTopo;
+static cpuTopo topo[MAX_CORES];
+static int topoLoaded = 0;
+static cpu_set_t allowedCpus;
+static int placedCpu = -1;      /* CPU the thread is pinned to, -1 for all of allowedCpus */
+static long tot_migrations = 0;
+static void place_worker(tcb *t);
+
+// BULK CREATION: TCBs of one worker_create_n call
+typedef struct tcbBatch
+{
+	int live;           /* TCBs not reclaimed yet */
+	tcb *tcbs;
+} tcbBatch;
+
+// STACK CACHE: freed worker stacks, reused while their pages are still mapped
+static void *stackCache[STACK_CACHE_SIZE];
+static int numCachedStacks = 0;
+
+// WAKEUPS POSTED BY OTHER KERNEL THREADS, drained by the scheduler
+static int wakeLock = 0;
+static worker_t *pendingWakes = NULL;
+static int numPendingWakes = 0;
+static int maxPendingWakes = 0;
+// BLOCK LISTS TO WAKE, posted by unlock/signal on other kernel threads
+typedef struct pendingPost
+{
+	minHeap *waiters;
+	int all;            /* wake every waiter, not just the first */
+} pendingPost;
+static pendingPost *pendingPosts = NULL;
+static int numPendingPosts = 0;
+static int maxPendingPosts = 0;
+// KERNEL THREAD RUNNING THE WORKERS, and mutexes other kernel threads hold
+static pid_t runtimeTid = 0;
+static int remoteHolds = 0;
+
+// WORKERS IN A TIMED WAIT (worker_cond_timedwait)
+static tcb **timedWaits = NULL;
+static int numTimedWaits = 0;
+static int maxTimedWaits = 0;
+
 int initHeap(minHeap *h, int capacity) {
     h->arr = malloc(sizeof(tcb*) * capacity);
     if (!h->arr) {
@@ -32,143 +216,2111 @@ int initHeap(minHeap *h, int capacity) {
 	return 0;
 }
 
+/* monotonic clock in microseconds */
+static long now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* update a worker's slot in the metrics segment */
+static void metrics_worker(tcb *t)
+{
+	if (!metrics)
+		return;
+	int slot = t->tID % METRICS_MAX_WORKERS;
+	metrics->seq++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	metrics->workers[slot].tID = t->tID;
+	metrics->workers[slot].state = t->state;
+	metrics->workers[slot].cpuUsec = t->cpuTime;
+	if (slot >= metrics->numWorkers)
+		metrics->numWorkers = slot + 1;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	metrics->seq++;
+}
+
+/* monotonic clock in nanoseconds */
+static long now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Close the CPU burst of a worker that is leaving the CPU; under PSJF fold
+   it into its predicted next burst (exponential average, weight BURST_ALPHA).
+   Must be called before the worker is put back on any heap, since
+   timeQuant (and under MLFQ the priority) picks the heap. */
+static void charge_burst(tcb *t)
+{
+	if (!t || t->dispatchTime == 0)
+		return;
+
+	long burst = now_usec() - t->dispatchTime;
+	t->dispatchTime = 0;
+	t->lastBurst = burst;
+	t->cpuTime += burst;
+	groups[t->group].cpuTime += burst;
+	t->allotUsed += burst;
+#if defined(MLFQ)
+	/* Rule 4: demote once the allotment of the level is used up, however
+	   many times the worker gave up the CPU on the way */
+	if (t->allotUsed >= ((long)MLFQ_ALLOT_US << t->priority))
+	{
+		if (t->priority < NUMQUEUES - 1)
+			t->priority++;
+		t->allotUsed = 0;
+	}
+#elif defined(CFS)
+	t->vruntime += burst;
+	groups[t->group].vruntime += burst * GROUP_DEFAULT_WEIGHT / groups[t->group].weight;
+#else
+	/* only PSJF keys its heap by the prediction; MLFQ and CFS keep their
+	   own key in timeQuant */
+	t->timeQuant = (BURST_ALPHA * burst + (100 - BURST_ALPHA) * t->timeQuant) / 100;
+#endif
+	metrics_worker(t);
+}
+
+/* a worker leaves the CPU to wait for something */
+static void mark_blocked(tcb *t)
+{
+	t->state = BLOCKED;
+	numBlocked[t->priority]++;
+	metrics_worker(t);
+}
+
+/* publish the global counters; called once per scheduling decision */
+static void metrics_publish(void)
+{
+	if (!metrics)
+		return;
+	metrics->seq++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (int lvl = 0; lvl < NUMQUEUES; lvl++)
+	{
+#if defined(MLFQ)
+		metrics->runnable[lvl] = mlfq[lvl].threads;
+#else
+		metrics->runnable[lvl] = lvl == 0 ? runnable_count() : 0;
+#endif
+		metrics->blocked[lvl] = numBlocked[lvl];
+	}
+	metrics->contextSwitches = tot_cntx_switches;
+	metrics->preemptions = tot_preemptions;
+	metrics->mutexAcquired = tot_mutex_acquired;
+	metrics->mutexContended = tot_mutex_contended;
+	metrics->sliceUsec = sliceUsec;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	metrics->seq++;
+}
+
+/* number of workers waiting in the run queue(s) of the active policy */
+static int runnable_count(void)
+{
+#if defined(MLFQ)
+	int n = 0;
+	for (int lvl = 0; lvl < NUMQUEUES; lvl++)
+		n += mlfq[lvl].threads;
+	return n;
+#elif defined(CFS)
+	int n = 0;
+	for (int g = 0; g < MAX_GROUPS; g++)
+		n += groups[g].rq.threads;
+	return n;
+#else
+	return rq.threads;
+#endif
+}
+
+/* Retune sliceUsec. The cost of this switch (scheduler path since
+   schedule() was entered plus the calibrated swapcontext cost) is folded
+   into switchCostNs; the slice is then the larger of what keeps that
+   cost under SWITCH_OVERHEAD_PCT and an even share of TARGET_LATENCY
+   among the runnable workers, clamped to [QUANTUM_MIN_US, QUANTUM_MAX_US].
+   Changes smaller than 1/8 of the slice are ignored. */
+static void tune_quantum(void)
+{
+	if (schedEnterNs)
+	{
+		long sample = now_nsec() - schedEnterNs + 2 * swapCostNs;
+		switchCostNs = (7 * switchCostNs + sample) / 8;
+		schedEnterNs = 0;
+	}
+
+	long slice = switchCostNs * 100 / SWITCH_OVERHEAD_PCT / 1000;
+	long share = TARGET_LATENCY * 1000L / (runnable_count() + 1);
+	if (share < MIN_SCHED_GRN * 1000L)
+		share = MIN_SCHED_GRN * 1000L;
+	if (share > slice)
+		slice = share;
+	if (slice < QUANTUM_MIN_US)
+		slice = QUANTUM_MIN_US;
+	if (slice > QUANTUM_MAX_US)
+		slice = QUANTUM_MAX_US;
+
+	long diff = slice > sliceUsec ? slice - sliceUsec : sliceUsec - slice;
+	if (diff * 8 <= sliceUsec)
+		return;
+
+	quantumLog[quantumAdjustments % QUANTUM_LOG_SIZE][0] = sliceUsec;
+	quantumLog[quantumAdjustments % QUANTUM_LOG_SIZE][1] = slice;
+	quantumAdjustments++;
+	sliceUsec = slice;
+}
+
+/* start the one-shot preemption timer */
+static void arm_timer(long usec)
+{
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = usec / 1000000;
+	timer.it_value.tv_usec = usec % 1000000;
+	setitimer(ITIMER_VIRTUAL, &timer, NULL);
+}
+
+/* record the executable ranges of libc, libpthread and the dynamic loader */
+static int find_libc(struct dl_phdr_info *info, size_t size, void *data)
+{
+	const char *name = info->dlpi_name;
+	if (!name || (!strstr(name, "libc.so") && !strstr(name, "libc-") &&
+				  !strstr(name, "libpthread") && !strstr(name, "ld-linux")))
+		return 0;
+	for (int i = 0; i < info->dlpi_phnum; i++)
+	{
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X) ||
+			numLibcRanges == MAX_LIBC_RANGES)
+			continue;
+		libcRange[numLibcRanges][0] = info->dlpi_addr + ph->p_vaddr;
+		libcRange[numLibcRanges][1] = info->dlpi_addr + ph->p_vaddr + ph->p_memsz;
+		numLibcRanges++;
+	}
+	return 0;
+}
+
+/* was the worker interrupted inside libc? */
+static int in_libc(void *ucontext)
+{
+	ucontext_t *uc = ucontext;
+	uintptr_t pc;
+#if defined(__x86_64__)
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+	pc = uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+	pc = uc->uc_mcontext.pc;
+#else
+	/* no way to read the pc: treat every interrupt as unsafe to switch */
+	return numLibcRanges > 0;
+#endif
+	for (int i = 0; i < numLibcRanges; i++)
+		if (pc >= libcRange[i][0] && pc < libcRange[i][1])
+			return 1;
+	return 0;
+}
+
+/* preemption: hand the running worker back to the scheduler */
+static void timer_handler(int signum, siginfo_t *info, void *ucontext)
+{
+	if (!current || current->state != RUNNING)
+		return;
+	if (inRuntime)
+	{
+		/* switch out once the worker leaves the runtime */
+		preemptPending = 1;
+		return;
+	}
+	if (in_libc(ucontext))
+	{
+		/* libc has no exit hook: try again shortly */
+		preemptPending = 1;
+		arm_timer(QUANTUM_MIN_US);
+		return;
+	}
+	tot_preemptions++;
+	swapcontext(&current->context, &schedCtx);
+	LEAVE_RUNTIME();
+}
+
+/* a preemption held off inside the runtime takes effect here */
+static void preempt_point(void)
+{
+	preemptPending = 0;
+	if (!current || current->state != RUNNING)
+		return;
+	tot_preemptions++;
+	inRuntime = 1;
+	swapcontext(&current->context, &schedCtx);
+	inRuntime = 0;
+}
+
+/* measure the raw cost of one swapcontext */
+static ucontext_t calibMain, calibCtx;
+
+static void calib_loop(void)
+{
+	for (;;)
+		swapcontext(&calibCtx, &calibMain);
+}
+
+static void calibrate_switch(void)
+{
+	const int rounds = 1000;
+	size_t stackSize = 16384;
+	void *stack = malloc(stackSize);
+	if (!stack)
+		return;
+
+	getcontext(&calibCtx);
+	calibCtx.uc_stack.ss_sp = stack;
+	calibCtx.uc_stack.ss_size = stackSize;
+	calibCtx.uc_link = NULL;
+	makecontext(&calibCtx, calib_loop, 0);
+
+	long start = now_nsec();
+	for (int i = 0; i < rounds; i++)
+		swapcontext(&calibMain, &calibCtx);
+	swapCostNs = (now_nsec() - start) / (2 * rounds);
+	switchCostNs = 2 * swapCostNs;
+
+	free(stack);
+}
+
+/* grow tcbTable to hold tIDs below size */
+static int reserve_tcb_table(int size)
+{
+	if (size > tcbTableSize)
+	{
+		int newSize = tcbTableSize ? tcbTableSize * 2 : 64;
+		while (newSize < size)
+			newSize *= 2;
+		tcb **grown = realloc(tcbTable, newSize * sizeof(tcb *));
+		if (!grown)
+			return -1;
+		memset(grown + tcbTableSize, 0, (newSize - tcbTableSize) * sizeof(tcb *));
+		tcbTable = grown;
+		tcbTableSize = newSize;
+	}
+	return 0;
+}
+
+/* add t to tcbTable */
+static int register_tcb(tcb *t)
+{
+	if (reserve_tcb_table(t->tID + 1) == -1)
+		return -1;
+	tcbTable[t->tID] = t;
+	return 0;
+}
+
+static tcb *lookup_tcb(worker_t tID)
+{
+	if (tID < 0 || tID >= tcbTableSize)
+		return NULL;
+	return tcbTable[tID];
+}
+
+/* stack pointer saved in a switched-out context */
+static char *context_sp(ucontext_t *ctx)
+{
+#if defined(__x86_64__)
+	return (char *)ctx->uc_mcontext.gregs[REG_RSP];
+#elif defined(__i386__)
+	return (char *)ctx->uc_mcontext.gregs[REG_ESP];
+#elif defined(__aarch64__)
+	return (char *)ctx->uc_mcontext.sp;
+#else
+	return NULL;
+#endif
+}
+
+/* copy the used part of the owner's shared stack out to its own buffer */
+static void stack_save(tcb *t)
+{
+	char *base = sharedStacks[t->sharedStack].base;
+	char *top = base + SHARED_STACK_SIZE;
+	char *sp = context_sp(&t->context);
+
+	/* keep the x86-64 red zone; unknown ABI: save everything */
+	sp = sp ? sp - 128 : base;
+	if (sp < base)
+		sp = base;
+	size_t used = top - sp;
+
+	/* right-size the buffer: grow to fit, shrink when mostly unused */
+	if (!t->saved || used > t->savedSize || used < t->savedSize / 2)
+	{
+		void *buf = realloc(t->saved, used);
+		if (!buf)
+		{
+			perror("thread-worker: stack save");
+			exit(1);
+		}
+		t->saved = buf;
+	}
+	memcpy(t->saved, sp, used);
+	t->savedSize = used;
+	tot_stack_saves++;
+	tot_stack_bytes += used;
+}
+
+/* Make t's frames live on its shared stack before switching to it. Runs
+   on the scheduler stack. Copies are lazy: the owner is only saved when
+   another worker needs the stack, so a worker that runs again right away
+   costs nothing. */
+static void stack_claim(tcb *t)
+{
+	if (t->sharedStack < 0)
+		return;
+	sharedStack *ss = &sharedStacks[t->sharedStack];
+	if (ss->owner == t)
+		return;
+	if (ss->owner)
+		stack_save(ss->owner);
+	ss->owner = t;
+
+	if (!t->started)
+	{
+		makecontext(&t->context, worker_start, 0);
+		t->started = 1;
+	}
+	else if (t->saved)
+	{
+		memcpy(ss->base + SHARED_STACK_SIZE - t->savedSize, t->saved, t->savedSize);
+		tot_stack_bytes += t->savedSize;
+	}
+}
+
+/* context for worker-to-worker switches that need a stack_claim first */
+static void stack_switch_loop(void)
+{
+	for (;;)
+	{
+		tcb *t = switchTarget;
+		stack_claim(t);
+		swapcontext(&stackSwitchCtx, &t->context);
+	}
+}
+
+/* switch from prev (which stays on its stack) straight to t */
+static void stack_switch(tcb *prev, tcb *t)
+{
+	if (t->sharedStack < 0 || sharedStacks[t->sharedStack].owner == t)
+	{
+		swapcontext(&prev->context, &t->context);
+		return;
+	}
+	switchTarget = t;
+	swapcontext(&prev->context, &stackSwitchCtx);
+}
+
+/* drop a finished worker's claim on its shared stack */
+static void stack_release(tcb *t)
+{
+	if (t->sharedStack >= 0 && sharedStacks[t->sharedStack].owner == t)
+		sharedStacks[t->sharedStack].owner = NULL;
+	free(t->saved);
+	t->saved = NULL;
+	t->savedSize = 0;
+}
+
+/* A new worker stack. Cached stacks have their pages faulted in already,
+   which is most of what creating a worker costs. */
+static void *alloc_stack(void)
+{
+	if (numCachedStacks > 0)
+		return stackCache[--numCachedStacks];
+	return malloc(WORKER_STACK_SIZE);
+}
+
+static void free_stack(tcb *t)
+{
+	if (!t->stack)
+		return;
+	if (numCachedStacks < STACK_CACHE_SIZE)
+		stackCache[numCachedStacks++] = t->stack;
+	else
+		free(t->stack);
+	t->stack = NULL;
+}
+
+/* free a TCB that is off tcbTable; the last TCB of a batch frees it */
+static void free_tcb(tcb *t)
+{
+	tcbBatch *batch = t->batch;
+	if (!batch)
+	{
+		free(t);
+		return;
+	}
+	if (--batch->live == 0)
+	{
+		free(batch->tcbs);
+		free(batch);
+	}
+}
+
+/* release what a finished worker no longer needs; detached workers have
+   nobody to join them, so their TCB goes too */
+static void reap_finished(tcb *t)
+{
+	metrics_worker(t);
+	stack_release(t);
+	free_stack(t);
+	if (t->detached)
+	{
+		tcbTable[t->tID] = NULL;
+		free_tcb(t);
+	}
+}
+
+/* entry point of every worker context */
+static void worker_start(void)
+{
+	LEAVE_RUNTIME();
+	worker_exit(current->func(current->arg));
+}
+
+/* the scheduler context: run the policy until nothing can run any more */
+static void sched_loop(void)
+{
+	for (;;)
+	{
+		schedule();
+		if (!current)
+		{
+			if (mainTCB->state == FINISHED)
+				exit(0);
+			fprintf(stderr, "thread-worker: no runnable workers left\n");
+			exit(1);
+		}
+	}
+}
+
+/* write the WORKER_PROF_HZ profile at exit */
+static void prof_atexit(void)
+{
+	const char *out = getenv("WORKER_PROF_OUT");
+	worker_prof_stop(out ? out : "worker-prof.folded");
+}
+
+/* write the WORKER_LOCK_PROF report at exit */
+static void lock_prof_atexit(void)
+{
+	worker_mutex_prof_report(getenv("WORKER_LOCK_PROF_OUT"));
+}
+
+/* one-time runtime setup, done on the first worker_create */
+static void worker_runtime_init(void)
+{
+	static int initialized = 0;
+	if (initialized)
+		return;
+	initialized = 1;
+	runtimeTid = (pid_t)syscall(SYS_gettid);
+
+	/* the calling thread becomes a worker too, so it can join */
+	mainTCB = calloc(1, sizeof(tcb));
+	if (!mainTCB)
+	{
+		perror("thread-worker: main tcb");
+		exit(1);
+	}
+	mainTCB->tID = threadID++;
+	mainTCB->state = RUNNING;
+	mainTCB->timeQuant = BURST_INITIAL;
+	mainTCB->dispatchTime = now_usec();
+	mainTCB->sharedStack = -1;
+	mainTCB->cpu = -1;
+	groups[0].used = 1;
+	groups[0].weight = GROUP_DEFAULT_WEIGHT;
+	groups[0].members = 1;
+	register_tcb(mainTCB);
+	current = mainTCB;
+
+	schedStack = malloc(SCHED_STACK_SIZE);
+	if (!schedStack)
+	{
+		perror("thread-worker: scheduler stack");
+		exit(1);
+	}
+	getcontext(&schedCtx);
+	schedCtx.uc_stack.ss_sp = schedStack;
+	schedCtx.uc_stack.ss_size = SCHED_STACK_SIZE;
+	schedCtx.uc_stack.ss_flags = 0;
+	schedCtx.uc_link = NULL;
+	makecontext(&schedCtx, sched_loop, 0);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = &timer_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigaction(SIGVTALRM, &sa, NULL);
+	dl_iterate_phdr(find_libc, NULL);
+
+	calibrate_switch();
+	tune_quantum();
+
+	const char *cpus = getenv("WORKER_CPUS");
+	if (cpus && *cpus && worker_set_cpus(cpus) == -1)
+		fprintf(stderr, "thread-worker: bad WORKER_CPUS \"%s\"\n", cpus);
+
+	const char *shared = getenv("WORKER_SHARED_STACKS");
+	if (shared && atoi(shared) > 0)
+		worker_shared_stacks(atoi(shared));
+
+	const char *live = getenv("WORKER_METRICS");
+	if (live && *live && strcmp(live, "0") != 0)
+		worker_metrics_open();
+
+	/* opt-in profiling for programs we cannot modify (LD_PRELOAD) */
+	const char *hz = getenv("WORKER_PROF_HZ");
+	if (hz && atoi(hz) > 0 && worker_prof_start(atoi(hz)) == 0)
+		atexit(prof_atexit);
+
+	const char *locks = getenv("WORKER_LOCK_PROF");
+	if (locks && *locks && strcmp(locks, "0") != 0 && worker_mutex_prof_start() == 0)
+		atexit(lock_prof_atexit);
+}
+
+/* Spinlock for the wakeup list; other kernel threads take it too. Not a
+   pthread mutex so the runtime never goes through pthread_mutex_* (which
+   the LD_PRELOAD build interposes). A worker takes it only with inRuntime
+   set: preempted while holding it, the scheduler would spin in
+   drain_wakeups() forever. */
+static void wake_lock(void)
+{
+	while (__atomic_test_and_set(&wakeLock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void wake_unlock(void)
+{
+	__atomic_clear(&wakeLock, __ATOMIC_RELEASE);
+}
+
+/* wake the scheduler if it is parked waiting for work */
+static void idle_kick(void)
+{
+	uint64_t one = 1;
+	/* the pending count was just raised; sched_idle() raises idleParked
+	   and then reads the counts, so one of us sees the other */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&idleParked, __ATOMIC_SEQ_CST) && idleFd >= 0)
+	{
+		if (write(idleFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("write idleFd");
+	}
+}
+
+/* Workers and groups coming back from a sleep are placed at most half a
+   target latency behind the rest, so they get a short head start instead
+   of all the CPU they missed. */
+static void cfs_place(tcb *t)
+{
+	workerGroup *g = &groups[t->group];
+	long credit = TARGET_LATENCY * 1000L / 2;
+
+	if (g->rq.threads == 0 && g->vruntime < cfsMinVruntime - credit)
+		g->vruntime = cfsMinVruntime - credit;
+	if (t->vruntime < g->minVruntime - credit)
+		t->vruntime = g->minVruntime - credit;
+}
+
+/* queue t on its group */
+static void cfs_enqueue(tcb *t)
+{
+	cfs_place(t);
+	t->timeQuant = t->vruntime;
+	enqueue(&groups[t->group].rq, t);
+}
+
+/* next is about to run: move the group's and the global floor up to it */
+static void cfs_advance(tcb *next)
+{
+	workerGroup *g = &groups[next->group];
+	if (next->vruntime > g->minVruntime)
+		g->minVruntime = next->vruntime;
+	if (g->vruntime > cfsMinVruntime)
+		cfsMinVruntime = g->vruntime;
+}
+
+/* runnable group with the smallest vruntime, or NULL */
+static workerGroup *cfs_min_group(void)
+{
+	workerGroup *best = NULL;
+	for (int i = 0; i < MAX_GROUPS; i++)
+	{
+		workerGroup *g = &groups[i];
+		if (g->rq.threads > 0 && (!best || g->vruntime < best->vruntime))
+			best = g;
+	}
+	return best;
+}
+
+/* fairness between groups first, then within the group */
+static tcb *cfs_pick(void)
+{
+	workerGroup *g = cfs_min_group();
+	if (!g)
+		return NULL;
+
+	tcb *next = dequeue(&g->rq);
+	cfs_advance(next);
+	return next;
+}
+
+/* MLFQ: a worker that blocked (mutex, join, park, I/O) gives the CPU up
+   before its allotment is gone; move it up so interactive workers don't
+   sink to the levels of the CPU hogs */
+static void wake_boost(tcb *t)
+{
+#if defined(MLFQ)
+	if (MLFQ_WAKE_BOOST > 0 && t->priority > 0)
+	{
+		t->priority = t->priority > MLFQ_WAKE_BOOST ? t->priority - MLFQ_WAKE_BOOST : 0;
+		t->allotUsed = 0;
+		tot_wake_boosts++;
+	}
+#endif
+}
+
+/* MLFQ: each level is round-robin, so its heap is keyed by enqueue order */
+static void mlfq_enqueue(tcb *t)
+{
+	static long mlfqSeq = 0;
+	t->timeQuant = ++mlfqSeq;
+	enqueue(&mlfq[t->priority], t);
+}
+
+/* a blocked worker is about to run again; boost (MLFQ) or place (CFS)
+   it before anyone looks at its priority or vruntime */
+static void unblock(tcb *t)
+{
+	if (t->state == BLOCKED)
+	{
+		numBlocked[t->priority]--;
+		wake_boost(t);
+#if defined(CFS)
+		cfs_place(t);
+#endif
+		t->state = READY;
+	}
+}
+
+/* put a worker on the run queue of the active policy */
+static void make_ready(tcb *t)
+{
+	unblock(t);
+	t->state = READY;
+#if defined(MLFQ)
+	mlfq_enqueue(t);
+#elif defined(CFS)
+	cfs_enqueue(t);
+#else
+	enqueue(&rq, t);
+#endif
+	idle_kick();
+}
+
+/* is the caller a kernel thread other than the one running the workers? */
+static int off_runtime_thread(void)
+{
+	static __thread pid_t myTid = 0;
+	if (!runtimeTid)
+		return 0;
+	if (!myTid)
+		myTid = (pid_t)syscall(SYS_gettid);
+	return myTid != runtimeTid;
+}
+
+/* forget the deadline of a worker leaving a timed wait */
+static void timed_cancel(tcb *t)
+{
+	if (!t->wakeAt)
+		return;
+	for (int i = 0; i < numTimedWaits; i++)
+	{
+		if (timedWaits[i] == t)
+		{
+			timedWaits[i] = timedWaits[--numTimedWaits];
+			break;
+		}
+	}
+	t->wakeAt = 0;
+	t->waitingOn = NULL;
+}
+
+/* t sleeps on waiters until deadline (CLOCK_MONOTONIC nsec) at the latest */
+static int timed_add(tcb *t, minHeap *waiters, long deadline)
+{
+	if (numTimedWaits == maxTimedWaits)
+	{
+		int newMax = maxTimedWaits ? maxTimedWaits * 2 : 16;
+		tcb **grown = realloc(timedWaits, newMax * sizeof(tcb *));
+		if (!grown)
+			return -1;
+		timedWaits = grown;
+		maxTimedWaits = newMax;
+	}
+	t->wakeAt = deadline;
+	t->waitingOn = waiters;
+	t->timedOut = 0;
+	timedWaits[numTimedWaits++] = t;
+	return 0;
+}
+
+/* move the workers whose deadline passed off their block list */
+static void expire_waits(void)
+{
+	if (numTimedWaits == 0)
+		return;
+
+	long now = now_nsec();
+	int i = 0;
+	while (i < numTimedWaits)
+	{
+		tcb *t = timedWaits[i];
+		if (t->wakeAt > now)
+		{
+			i++;
+			continue;
+		}
+		timedWaits[i] = timedWaits[--numTimedWaits];
+		removeNode(t->waitingOn, t->tID);
+		t->wakeAt = 0;
+		t->waitingOn = NULL;
+		t->timedOut = 1;
+		make_ready(t);
+	}
+}
+
+/* nsec until the earliest timed wait expires, -1 if there is none */
+static long next_expiry(void)
+{
+	if (numTimedWaits == 0)
+		return -1;
+
+	long first = timedWaits[0]->wakeAt;
+	for (int i = 1; i < numTimedWaits; i++)
+		if (timedWaits[i]->wakeAt < first)
+			first = timedWaits[i]->wakeAt;
+	long left = first - now_nsec();
+	return left > 0 ? left : 0;
+}
+
+/* move the first (or every) worker on a block list to the run queue */
+static void wake_waiters(minHeap *waiters, int all)
+{
+	while (waiters->threads > 0)
+	{
+		tcb *t = dequeue(waiters);
+		timed_cancel(t);
+		make_ready(t);
+		if (!all)
+			break;
+	}
+}
+
+/* Block lists belong to the scheduler: another kernel thread posts the
+   list instead, and the scheduler wakes its waiters in drain_wakeups. */
+static int post_waiters(minHeap *waiters, int all)
+{
+	wake_lock();
+	if (numPendingPosts == maxPendingPosts)
+	{
+		int newMax = maxPendingPosts ? maxPendingPosts * 2 : 16;
+		pendingPost *grown = realloc(pendingPosts, newMax * sizeof(pendingPost));
+		if (!grown)
+		{
+			wake_unlock();
+			return -1;
+		}
+		pendingPosts = grown;
+		maxPendingPosts = newMax;
+	}
+	pendingPosts[numPendingPosts].waiters = waiters;
+	pendingPosts[numPendingPosts].all = all;
+	numPendingPosts++;
+	wake_unlock();
+
+	idle_kick();
+	return 0;
+}
+
+/* consume a wakeup posted for tID before it parked, returns 1 if found */
+static int take_wakeup(worker_t tID)
+{
+	int found = 0;
+	wake_lock();
+	for (int i = 0; i < numPendingWakes; i++)
+	{
+		if (pendingWakes[i] == tID)
+		{
+			pendingWakes[i] = pendingWakes[--numPendingWakes];
+			found = 1;
+			break;
+		}
+	}
+	wake_unlock();
+	return found;
+}
+
+/* move parked workers that were woken by worker_wake() to the run queue */
+static void drain_wakeups(void)
+{
+	wake_lock();
+	int i = 0;
+	while (i < numPendingWakes)
+	{
+		tcb *node = searchByTID(&parkList, pendingWakes[i]);
+		if (node)
+		{
+			removeNode(&parkList, node->tID);
+			make_ready(node);
+			pendingWakes[i] = pendingWakes[--numPendingWakes];
+		}
+		else
+		{
+			/* not parked yet, worker_park() will consume it */
+			i++;
+		}
+	}
+	for (i = 0; i < numPendingPosts; i++)
+		wake_waiters(pendingPosts[i].waiters, pendingPosts[i].all);
+	numPendingPosts = 0;
+	wake_unlock();
+}
+
+/* Called by the policies when no worker is runnable. Parks the kernel
+   thread on idleFd until work is enqueued, a wakeup is posted or one
+   quantum passes (so timers still get serviced). Returns 1 if the caller
+   should look for work again, 0 if nothing can ever become runnable. */
+static int sched_idle(void)
+{
+	drain_wakeups();
+	expire_waits();
+	if (runnable_count() > 0)
+		return 1;
+	/* only a wakeup, a deadline or another kernel thread can help now */
+	if (parkList.threads == 0 && numTimedWaits == 0 &&
+		__atomic_load_n(&remoteHolds, __ATOMIC_SEQ_CST) == 0)
+		return 0;
+
+	if (idleFd < 0)
+	{
+		idleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (idleFd < 0)
+		{
+			perror("eventfd");
+			return 0;
+		}
+	}
+
+	long start = now_usec();
+	struct pollfd pfd = { .fd = idleFd, .events = POLLIN };
+
+	int timeout = QUANTUM;
+	long left = next_expiry();
+	if (left >= 0 && left / 1000000 < timeout)
+		timeout = left / 1000000 + 1;
+
+	__atomic_store_n(&idleParked, 1, __ATOMIC_SEQ_CST);
+	/* a wakeup may have been posted while we were setting up */
+	if (__atomic_load_n(&numPendingWakes, __ATOMIC_SEQ_CST) == 0 &&
+		__atomic_load_n(&numPendingPosts, __ATOMIC_SEQ_CST) == 0)
+	{
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			perror("poll idleFd");
+	}
+	__atomic_store_n(&idleParked, 0, __ATOMIC_SEQ_CST);
+
+	uint64_t count;
+	while (read(idleFd, &count, sizeof(count)) > 0)
+		;
+
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+		cpu = 0;
+	idleTime[cpu % MAX_CORES] += now_usec() - start;
+	idleParks++;
+
+	drain_wakeups();
+	expire_waits();
+	return 1;
+}
+
+
+int worker_create(worker_t *thread, pthread_attr_t *attr,
+				  void *(*function)(void *), void *arg)
+{
+	return worker_create_group(thread, 0, attr, function, arg);
+};
+
+/* create a fair-share group */
+int worker_group_create(int weight)
+{
+	if (weight <= 0)
+	{
+		return -1;
+	}
+	worker_runtime_init();
+	for (int i = 1; i < MAX_GROUPS; i++)
+	{
+		if (!groups[i].used)
+		{
+			memset(&groups[i], 0, sizeof(workerGroup));
+			groups[i].used = 1;
+			groups[i].weight = weight;
+			groups[i].vruntime = cfsMinVruntime;
+			return i;
+		}
+	}
+	return -1;
+};
+
+/* change the weight of a group */
+int worker_group_set_weight(int group, int weight)
+{
+	if (group < 0 || group >= MAX_GROUPS || !groups[group].used || weight <= 0)
+	{
+		return -1;
+	}
+	groups[group].weight = weight;
+	return 0;
+};
+
+/* run workers created from now on on n shared stacks */
+int worker_shared_stacks(int n)
+{
+	if (n < 0 || n > MAX_SHARED_STACKS)
+	{
+		return -1;
+	}
+	worker_runtime_init();
+	ENTER_RUNTIME();
+	if (n > 0 && !stackSwitchStack)
+	{
+		stackSwitchStack = malloc(STACK_SWITCH_SIZE);
+		if (!stackSwitchStack)
+		{
+			LEAVE_RUNTIME();
+			return -1;
+		}
+		getcontext(&stackSwitchCtx);
+		stackSwitchCtx.uc_stack.ss_sp = stackSwitchStack;
+		stackSwitchCtx.uc_stack.ss_size = STACK_SWITCH_SIZE;
+		stackSwitchCtx.uc_stack.ss_flags = 0;
+		stackSwitchCtx.uc_link = NULL;
+		makecontext(&stackSwitchCtx, stack_switch_loop, 0);
+	}
+	for (int i = numSharedStacks; i < n; i++)
+	{
+		if (!sharedStacks[i].base)
+		{
+			sharedStacks[i].base = malloc(SHARED_STACK_SIZE);
+			if (!sharedStacks[i].base)
+			{
+				LEAVE_RUNTIME();
+				return -1;
+			}
+		}
+	}
+	/* stacks beyond n stay allocated for the workers already on them */
+	numSharedStacks = n;
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* create a new thread in a fair-share group */
+int worker_create_group(worker_t *thread, int group, pthread_attr_t *attr,
+						void *(*function)(void *), void *arg)
+{
+	return create_worker(thread, group, -1, attr, function, arg);
+};
+
+/* worker_create with every option: group and CPU placement */
+static int create_worker(worker_t *thread, int group, int cpu, pthread_attr_t *attr,
+						 void *(*function)(void *), void *arg)
+{
+	void *stackAddress = NULL;
+	size_t stackSize = 0;
+
+	worker_runtime_init();
+	if (group < 0 || group >= MAX_GROUPS || !groups[group].used)
+	{
+		return -1;
+	}
+	ENTER_RUNTIME();
+
+	if (numSharedStacks == 0)
+	{
+		stackSize = WORKER_STACK_SIZE;
+		stackAddress = alloc_stack();
+		if (!stackAddress)
+		{
+			LEAVE_RUNTIME();
+			return -1;
+		}
+	}
+
+	ucontext_t epicContext;
+	getcontext(&epicContext);
+
+	tcb *block = malloc(sizeof(tcb));
+	if (block)
+	{
+		init_tcb(block, &epicContext, stackAddress, stackSize, group, cpu, function, arg);
+		*thread = block->tID;
+	}
+	if (!block || register_tcb(block) == -1)
+	{
+		free(block);
+		free(stackAddress);
+		LEAVE_RUNTIME();
+		return -1;
+	}
+	groups[group].members++;
+	make_ready(block);
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* Set up a new worker from a getcontext() template. stack is NULL in
+   copy-stack mode, where the worker gets a shared stack instead. */
+static void init_tcb(tcb *block, ucontext_t *tmpl, void *stack, size_t stackSize,
+					 int group, int cpu, void *(*function)(void *), void *arg)
+{
+	int shared = -1;
+	if (!stack)
+	{
+		/* spread workers over the shared stacks; makecontext waits for
+		   stack_claim since it writes to the stack */
+		shared = nextSharedStack++ % numSharedStacks;
+		stack = sharedStacks[shared].base;
+		stackSize = SHARED_STACK_SIZE;
+	}
+
+	block->tID = threadID++;
+	block->state = READY;
+	block->context = *tmpl;
+	block->context.uc_stack.ss_sp = stack;
+	block->context.uc_stack.ss_size = stackSize;
+	block->context.uc_stack.ss_flags = 0;
+	block->context.uc_link = NULL;
+	if (shared < 0)
+		makecontext(&block->context, worker_start, 0);
+	block->stack = shared < 0 ? stack : NULL;
+	block->sharedStack = shared;
+	block->started = shared < 0;
+	block->saved = NULL;
+	block->savedSize = 0;
+	block->next = NULL;
+	block->priority = 0;
+	block->pc = 0;
+	block->timeQuant = BURST_INITIAL;
+	block->lastBurst = 0;
+	block->dispatchTime = 0;
+	block->func = function;
+	block->arg = arg;
+	block->joiner = NULL;
+	block->waitCount = 0;
+	block->batch = NULL;
+	block->detached = 0;
+	block->cpuTime = 0;
+	block->allotUsed = 0;
+	block->cpu = cpu;
+	block->group = group;
+	/* start level with the group instead of owing it all its CPU */
+	block->vruntime = groups[group].minVruntime;
+}
+
+/* create n workers with one allocation for their TCBs, one getcontext
+   and one run queue resize */
+int worker_create_n(worker_t *threads, int n, pthread_attr_t *attr,
+					void *(*function)(void *), void **args)
+{
+	if (!threads || n <= 0)
+	{
+		return -1;
+	}
+	worker_runtime_init();
+	ENTER_RUNTIME();
+
+	tcbBatch *batch = calloc(1, sizeof(tcbBatch));
+	void **stacks = calloc(n, sizeof(void *));
+	if (batch)
+	{
+		batch->tcbs = malloc(n * sizeof(tcb));
+	}
+	int haveStacks = stacks != NULL;
+	for (int i = 0; i < n && haveStacks && numSharedStacks == 0; i++)
+	{
+		stacks[i] = alloc_stack();
+		haveStacks = stacks[i] != NULL;
+	}
+#if defined(MLFQ)
+	minHeap *queue = &mlfq[0];
+#elif defined(CFS)
+	minHeap *queue = &groups[0].rq;
+#else
+	minHeap *queue = &rq;
+#endif
+	if (!batch || !batch->tcbs || !haveStacks ||
+		reserve_tcb_table(threadID + n) == -1 || heapReserve(queue, n) == -1)
+	{
+		for (int i = 0; stacks && i < n; i++)
+			free(stacks[i]);
+		free(stacks);
+		if (batch)
+			free(batch->tcbs);
+		free(batch);
+		LEAVE_RUNTIME();
+		return -1;
+	}
+	batch->live = n;
+
+	ucontext_t epicContext;
+	getcontext(&epicContext);
+	for (int i = 0; i < n; i++)
+	{
+		tcb *block = &batch->tcbs[i];
+		init_tcb(block, &epicContext, stacks[i], WORKER_STACK_SIZE, 0, -1,
+				 function, args ? args[i] : NULL);
+		block->batch = batch;
+		tcbTable[block->tID] = block;
+		threads[i] = block->tID;
+	}
+	free(stacks);
+	groups[0].members += n;
+	for (int i = 0; i < n; i++)
+	{
+		make_ready(&batch->tcbs[i]);
+	}
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* give CPU possession to other user-level worker threads voluntarily */
+int worker_yield()
+{
+	if (!current)
+	{
+		return 0;
+	}
+	ENTER_RUNTIME();
+	charge_burst(current);
+	make_ready(current);
+	swapcontext(&current->context, &schedCtx);
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* terminate a thread */
+void worker_exit(void *value_ptr)
+{
+	ENTER_RUNTIME();
+	charge_burst(current);
+	current->state = FINISHED;
+	current->retValue = value_ptr;
+	if (current->joiner)
+	{
+		/* worker_join_all waiters wake for the last one only */
+		if (--current->joiner->waitCount <= 0)
+			make_ready(current->joiner);
+		current->joiner = NULL;
+	}
+	workerGroup *g = &groups[current->group];
+	g->members--;
+	if (g->waiter && g->members <= g->waitFor)
+	{
+		make_ready(g->waiter);
+		g->waiter = NULL;
+	}
+	setcontext(&schedCtx);
+};
+
+/* Wait for thread termination */
+int worker_join(worker_t thread, void **value_ptr)
+{
+	ENTER_RUNTIME();
+	tcb *block = lookup_tcb(thread);
+	if (!block || block == current || block->detached || block->joiner)
+	{
+		LEAVE_RUNTIME();
+		return -1;
+	}
+	if (block->state != FINISHED)
+	{
+		/* worker_exit of the target makes us ready again */
+		charge_burst(current);
+		mark_blocked(current);
+		block->joiner = current;
+		current->waitCount = 1;
+		swapcontext(&current->context, &schedCtx);
+	}
+	join_reap(block, value_ptr);
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* hand out a joined worker's return value and free it */
+static void join_reap(tcb *block, void **value_ptr)
+{
+	if (value_ptr)
+	{
+		*value_ptr = block->retValue;
+	}
+
+	tcbTable[block->tID] = NULL;
+	stack_release(block);
+	free_stack(block);
+	free_tcb(block);
+}
+
+/* wait for n workers, woken once by the last one to exit */
+int worker_join_all(worker_t *threads, int n, void **values)
+{
+	if (!threads || n < 0)
+	{
+		return -1;
+	}
+	ENTER_RUNTIME();
+	int running = 0;
+	for (int i = 0; i < n; i++)
+	{
+		tcb *block = lookup_tcb(threads[i]);
+		if (!block || block == current || block->detached || block->joiner)
+		{
+			/* also catches a thread listed twice; undo what we claimed */
+			for (int j = 0; j < i; j++)
+				lookup_tcb(threads[j])->joiner = NULL;
+			LEAVE_RUNTIME();
+			return -1;
+		}
+		block->joiner = current;
+		if (block->state != FINISHED)
+			running++;
+	}
+	if (running > 0)
+	{
+		charge_burst(current);
+		mark_blocked(current);
+		current->waitCount = running;
+		swapcontext(&current->context, &schedCtx);
+	}
+	for (int i = 0; i < n; i++)
+	{
+		join_reap(lookup_tcb(threads[i]), values ? &values[i] : NULL);
+	}
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* wait for the other members of a group to exit */
+int worker_group_wait(int group)
+{
+	if (group < 0 || group >= MAX_GROUPS || !groups[group].used || !current)
+	{
+		return -1;
+	}
+	ENTER_RUNTIME();
+	workerGroup *g = &groups[group];
+	if (g->waiter)
+	{
+		LEAVE_RUNTIME();
+		return -1;
+	}
+	g->waitFor = current->group == group ? 1 : 0;
+	if (g->members > g->waitFor)
+	{
+		charge_burst(current);
+		mark_blocked(current);
+		g->waiter = current;
+		swapcontext(&current->context, &schedCtx);
+	}
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* reclaim a thread when it exits instead of on worker_join */
+int worker_detach(worker_t thread)
+{
+	ENTER_RUNTIME();
+	tcb *block = lookup_tcb(thread);
+	if (!block || block->detached || block->joiner || block == mainTCB)
+	{
+		LEAVE_RUNTIME();
+		return -1;
+	}
+	block->detached = 1;
+	if (block->state == FINISHED)
+	{
+		reap_finished(block);
+	}
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* id of the calling worker */
+worker_t worker_self(void)
+{
+	return current ? current->tID : -1;
+};
+
+/* recursive and error-checking mutexes remember who holds them */
+static int mutex_tracks_owner(worker_mutex_t *mutex)
+{
+	return mutex->type == PTHREAD_MUTEX_RECURSIVE ||
+		   mutex->type == PTHREAD_MUTEX_ERRORCHECK;
+}
+
+/* owner id of the caller: worker id + 1 on the runtime thread, minus the
+   kernel thread id anywhere else; never 0 */
+static int mutex_owner_id(void)
+{
+	if (off_runtime_thread())
+		return -(int)syscall(SYS_gettid);
+	return current ? current->tID + 1 : 1;
+}
+
+/* the caller just took the lock */
+static void mutex_set_owner(worker_mutex_t *mutex)
+{
+	if (mutex_tracks_owner(mutex))
+	{
+		mutex->owner = mutex_owner_id();
+		mutex->count = 1;
+	}
+}
+
+/* initialize the mutex lock */
+int worker_mutex_init(worker_mutex_t *mutex,
+					  const pthread_mutexattr_t *mutexattr)
+{
+	int type = PTHREAD_MUTEX_DEFAULT;
+	if (mutexattr && pthread_mutexattr_gettype(mutexattr, &type) != 0)
+	{
+		return -1;
+	}
+	if (mutex)
+	{
+		mutex->type = type;
+		mutex->locked = 0;
+		mutex->owner = 0;
+		mutex->count = 0;
+		mutex->blockList.arr = NULL;
+		mutex->blockList.threads = 0;
+		mutex->blockList.threshold = 0;
+		mutex->prof = NULL;
+		if (lockProfOn)
+		{
+			/* lockProfs is runtime state: no switch halfway through the insert */
+			int onWorker = !off_runtime_thread();
+			if (onWorker)
+				ENTER_RUNTIME();
+			mutex_prof(mutex, __builtin_return_address(0));
+			if (onWorker)
+				LEAVE_RUNTIME();
+		}
+		return 0;
+	}
+	else
+	{
+		return -1;
+	}
+};
+
+/* aquire the mutex lock */
+int worker_mutex_lock(worker_mutex_t *mutex)
+{
+	return worker_mutex_lock_at(mutex, __builtin_return_address(0));
+};
 
-int worker_create(worker_t *thread, pthread_attr_t *attr,
-				  void *(*function)(void *), void *arg)
+/* aquire the mutex lock on behalf of site */
+int worker_mutex_lock_at(worker_mutex_t *mutex, void *site)
 {
-	void *stackAddress = NULL;
-	size_t stackSize = 0;
+	/* only the holder can find its own id in owner */
+	if (mutex_tracks_owner(mutex) && mutex->owner == mutex_owner_id())
+	{
+		if (mutex->type == PTHREAD_MUTEX_ERRORCHECK)
+		{
+			errno = EDEADLK;
+			return -1;
+		}
+		mutex->count++;
+		return 0;
+	}
 
-	if (stackSize == 0)
+	// - use the built-in test-and-set atomic function to test the mutex
+	if (off_runtime_thread())
 	{
-		stackSize = 2048 * 32;
+		/* another kernel thread cannot block as a worker: spin */
+		while (__atomic_test_and_set(&mutex->locked, __ATOMIC_SEQ_CST))
+			sched_yield();
+		__atomic_add_fetch(&remoteHolds, 1, __ATOMIC_SEQ_CST);
+		mutex_set_owner(mutex);
+		return 0;
 	}
-	stackAddress = malloc(stackSize);
-	if (!stackAddress)
+	if (!current)
 	{
-		return -1;
+		/* no workers yet, nobody else can be holding it */
+		while (__atomic_test_and_set(&mutex->locked, __ATOMIC_SEQ_CST))
+			;
+		mutex_set_owner(mutex);
+		return 0;
 	}
 
-	ucontext_t epicContext;
-	getcontext(&epicContext);
-	epicContext.uc_stack.ss_sp = stackAddress;
-	epicContext.uc_stack.ss_size = stackSize;
-	epicContext.uc_stack.ss_flags = 0;
-	makecontext(&epicContext, (void (*)(void))function, 1, arg);
+	ENTER_RUNTIME();
+	tot_mutex_acquired++;
+	if (mutex->locked)
+	{
+		tot_mutex_contended++;
+	}
+	long waitStart = 0;
+	while (__atomic_test_and_set(&mutex->locked, __ATOMIC_SEQ_CST))
+	{
+		if (lockProfOn && !waitStart)
+		{
+			waitStart = now_nsec();
+		}
+		charge_burst(current);
+		mark_blocked(current);
+		enqueue(&mutex->blockList, current);
+		swapcontext(&current->context, &schedCtx);
+	}
+	mutex_set_owner(mutex);
+	if (lockProfOn)
+	{
+		mutex_prof_acquired(mutex, waitStart, site);
+	}
+	LEAVE_RUNTIME();
+	return 0;
+};
 
-	tcb *block = malloc(sizeof(tcb));
-	if (block)
+/* aquire the mutex lock if it is free */
+int worker_mutex_trylock(worker_mutex_t *mutex)
+{
+	if (mutex->type == PTHREAD_MUTEX_RECURSIVE && mutex->owner == mutex_owner_id())
 	{
-		block->tID = threadID++;
-		block->state = READY;
-		block->context = epicContext;
-		block->stack = stackAddress;
-		block->next = NULL;
-		*thread = block->tID;
+		mutex->count++;
+		return 0;
 	}
-	else
+	if (__atomic_test_and_set(&mutex->locked, __ATOMIC_SEQ_CST))
 	{
 		return -1;
 	}
-	enqueue(&rq, block);
+	mutex_set_owner(mutex);
+	if (off_runtime_thread())
+	{
+		__atomic_add_fetch(&remoteHolds, 1, __ATOMIC_SEQ_CST);
+	}
+	else if (current)
+	{
+		tot_mutex_acquired++;
+	}
+	return 0;
+};
+
+/* clear the lock and make its first waiter runnable, inside the runtime */
+static void mutex_release(worker_mutex_t *mutex)
+{
+	if (mutex->prof && mutex->prof->acquiredAt)
+	{
+		long held = now_nsec() - mutex->prof->acquiredAt;
+		mutex->prof->holdNs += held;
+		if (held > mutex->prof->maxHoldNs)
+			mutex->prof->maxHoldNs = held;
+		mutex->prof->acquiredAt = 0;
+	}
+	mutex->owner = 0;
+	__atomic_clear(&mutex->locked, __ATOMIC_SEQ_CST);
+	wake_waiters(&mutex->blockList, 0);
+}
+
+/* release the mutex lock */
+int worker_mutex_unlock(worker_mutex_t *mutex)
+{
+	if (mutex_tracks_owner(mutex))
+	{
+		if (mutex->owner != mutex_owner_id())
+		{
+			errno = EPERM;
+			return -1;
+		}
+		if (--mutex->count > 0)
+		{
+			return 0;
+		}
+	}
+
+	if (off_runtime_thread())
+	{
+		/* post the waiter before dropping the hold, so the scheduler
+		   never sees neither and gives up */
+		mutex->owner = 0;
+		__atomic_clear(&mutex->locked, __ATOMIC_SEQ_CST);
+		int ret = post_waiters(&mutex->blockList, 0);
+		__atomic_sub_fetch(&remoteHolds, 1, __ATOMIC_SEQ_CST);
+		return ret;
+	}
 
+	ENTER_RUNTIME();
+	mutex_release(mutex);
+	LEAVE_RUNTIME();
 	return 0;
 };
 
-/* give CPU possession to other user-level worker threads voluntarily */
-int worker_yield()
+/* block the calling worker until worker_wake() is called for it */
+int worker_park(void)
 {
-	current->state = READY;
-	enqueue(&rq, current);
+	if (!current)
+	{
+		return -1;
+	}
+
+	ENTER_RUNTIME();
+	if (take_wakeup(current->tID))
+	{
+		LEAVE_RUNTIME();
+		return 0;
+	}
+	charge_burst(current);
+	mark_blocked(current);
+	enqueue(&parkList, current);
 	swapcontext(&current->context, &schedCtx);
 
+	LEAVE_RUNTIME();
 	return 0;
 };
 
-/* terminate a thread */
-void worker_exit(void *value_ptr)
+/* make a parked worker runnable, may be called from any kernel thread */
+int worker_wake(worker_t thread)
 {
-	current->state = FINISHED;
-	current->retValue = value_ptr;
-	setcontext(&schedCtx);
+	int ret = 0;
+	int onWorker = !off_runtime_thread();
+	if (onWorker)
+		ENTER_RUNTIME();
+
+	wake_lock();
+	if (numPendingWakes == maxPendingWakes)
+	{
+		int newMax = maxPendingWakes ? maxPendingWakes * 2 : 16;
+		worker_t *grown = realloc(pendingWakes, newMax * sizeof(worker_t));
+		if (!grown)
+			ret = -1;
+		else
+		{
+			pendingWakes = grown;
+			maxPendingWakes = newMax;
+		}
+	}
+	if (ret == 0)
+		pendingWakes[numPendingWakes++] = thread;
+	wake_unlock();
+
+	if (ret == 0)
+		idle_kick();
+	if (onWorker)
+		LEAVE_RUNTIME();
+	return ret;
 };
 
-/* Wait for thread termination */
-int worker_join(worker_t thread, void **value_ptr)
+/* destroy the mutex */
+int worker_mutex_destroy(worker_mutex_t *mutex)
 {
-	tcb *block = searchByTID(&rq, thread);
-	if (!block)
+	if (mutex->locked == 1)
+	{
+		return -1;
+	}
+	if (mutex->blockList.threads != 0)
 	{
 		return -1;
 	}
-	while (block->state != FINISHED)
+	free(mutex->blockList.arr);
+	mutex->blockList.arr = NULL;
+	mutex->blockList.threshold = 0;
+	if (mutex->prof)
 	{
-		worker_yield();
+		/* keep the numbers for the report */
+		mutex->prof->destroyed = 1;
+		mutex->prof = NULL;
 	}
-	*value_ptr = block->retValue;
 
-	removeNode(&rq, block->tID);
-	free(block->stack);
-	free(block);
+	return 0;
+};
 
+/* initialize the condition variable */
+int worker_cond_init(worker_cond_t *cond, const pthread_condattr_t *attr)
+{
+	int pshared = PTHREAD_PROCESS_PRIVATE;
+	if (!cond)
+	{
+		return -1;
+	}
+	memset(cond, 0, sizeof(*cond));
+	cond->clock = CLOCK_REALTIME;
+	if (attr)
+	{
+		if (pthread_condattr_getclock(attr, &cond->clock) != 0 ||
+			pthread_condattr_getpshared(attr, &pshared) != 0 ||
+			pshared != PTHREAD_PROCESS_PRIVATE)
+		{
+			return -1;
+		}
+	}
 	return 0;
 };
 
-/* initialize the mutex lock */
-int worker_mutex_init(worker_mutex_t *mutex,
-					  const pthread_mutexattr_t *mutexattr)
+/* a kernel thread other than the workers' cannot sleep on the heap: it
+   watches the sequence number instead */
+static int cond_wait_remote(worker_cond_t *cond, worker_mutex_t *mutex, long deadline)
 {
-	if (mutex)
+	unsigned int seq = __atomic_load_n(&cond->seq, __ATOMIC_SEQ_CST);
+	int ret = 0;
+
+	worker_mutex_unlock(mutex);
+	while (__atomic_load_n(&cond->seq, __ATOMIC_SEQ_CST) == seq)
 	{
-		mutex->locked = 0;
+		if (deadline && now_nsec() >= deadline)
+		{
+			ret = -1;
+			break;
+		}
+		sched_yield();
+	}
+	worker_mutex_lock(mutex);
+	if (ret == -1)
+	{
+		errno = ETIMEDOUT;
+	}
+	return ret;
+}
+
+/* release mutex and sleep on the cond until signalled or deadline passes */
+static int cond_wait(worker_cond_t *cond, worker_mutex_t *mutex,
+					 const struct timespec *abstime)
+{
+	long deadline = 0;
+	if (abstime)
+	{
+		struct timespec now;
+		clock_gettime(cond->clock, &now);
+		long left = (abstime->tv_sec - now.tv_sec) * 1000000000L +
+					(abstime->tv_nsec - now.tv_nsec);
+		if (left <= 0)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		deadline = now_nsec() + left;
+	}
+	/* a recursive mutex is released however deep it is held, and comes
+	   back at the same depth */
+	int depth = 0;
+	if (mutex_tracks_owner(mutex))
+	{
+		if (mutex->owner != mutex_owner_id())
+		{
+			errno = EPERM;
+			return -1;
+		}
+		depth = mutex->count;
+		mutex->count = 1;
+	}
+	if (off_runtime_thread())
+	{
+		int ret = cond_wait_remote(cond, mutex, deadline);
+		if (depth)
+			mutex->count = depth;
+		return ret;
+	}
+	if (!current)
+	{
+		worker_runtime_init();
+	}
+
+	ENTER_RUNTIME();
+	current->timedOut = 0;
+	if (deadline && timed_add(current, &cond->waiters, deadline) == -1)
+	{
+		if (depth)
+			mutex->count = depth;
+		LEAVE_RUNTIME();
+		return -1;
+	}
+	charge_burst(current);
+	mark_blocked(current);
+	enqueue(&cond->waiters, current);
+	mutex_release(mutex);
+	swapcontext(&current->context, &schedCtx);
+	int timedOut = current->timedOut;
+	LEAVE_RUNTIME();
+
+	worker_mutex_lock_at(mutex, __builtin_return_address(0));
+	if (depth)
+	{
+		mutex->count = depth;
+	}
+	if (timedOut)
+	{
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
+}
+
+/* release mutex, block until signalled, take mutex again */
+int worker_cond_wait(worker_cond_t *cond, worker_mutex_t *mutex)
+{
+	return cond_wait(cond, mutex, NULL);
+};
+
+/* worker_cond_wait with a deadline on the cond's clock */
+int worker_cond_timedwait(worker_cond_t *cond, worker_mutex_t *mutex,
+						  const struct timespec *abstime)
+{
+	return cond_wait(cond, mutex, abstime);
+};
+
+static int cond_wake(worker_cond_t *cond, int all)
+{
+	__atomic_add_fetch(&cond->seq, 1, __ATOMIC_SEQ_CST);
+	if (off_runtime_thread())
+	{
+		return post_waiters(&cond->waiters, all);
+	}
+
+	ENTER_RUNTIME();
+	wake_waiters(&cond->waiters, all);
+	LEAVE_RUNTIME();
+	return 0;
+}
+
+/* wake one waiter */
+int worker_cond_signal(worker_cond_t *cond)
+{
+	return cond_wake(cond, 0);
+};
+
+/* wake every waiter */
+int worker_cond_broadcast(worker_cond_t *cond)
+{
+	return cond_wake(cond, 1);
+};
+
+/* destroy the condition variable */
+int worker_cond_destroy(worker_cond_t *cond)
+{
+	if (cond->waiters.threads != 0)
+	{
+		return -1;
+	}
+	free(cond->waiters.arr);
+	cond->waiters.arr = NULL;
+	cond->waiters.threshold = 0;
+	return 0;
+};
+
+/* Switch straight from the current worker to target, which must be off
+   every queue (just taken from a block list). The current worker goes
+   back on the run queue. */
+static void handoff_to(tcb *target)
+{
+	tcb *prev = current;
+	charge_burst(prev);
+	make_ready(prev);
+
+	unblock(target);
+#if defined(CFS)
+	/* the bookkeeping cfs_pick would have done */
+	cfs_advance(target);
+#endif
+	target->state = RUNNING;
+	target->dispatchTime = now_usec();
+	current = target;
+	metrics_worker(target);
+	tot_cntx_switches++;
+	tot_handoffs++;
+	arm_timer(sliceUsec);
+	preemptPending = 0;
+	metrics_publish();
+
+	place_worker(target);
+	stack_switch(prev, target);
+}
+
+/* Would the policy run target next anyway? Target must already be off
+   the run queue. PSJF: no queued worker has a shorter predicted burst.
+   MLFQ: no queued worker sits on a higher priority level.
+   CFS: target's group is the least served, and target is its least
+   served member. */
+static int handoff_allowed(tcb *target)
+{
+#if defined(MLFQ)
+	for (int lvl = 0; lvl < target->priority; lvl++)
+	{
+		if (mlfq[lvl].threads > 0)
+			return 0;
+	}
+	return 1;
+#elif defined(CFS)
+	workerGroup *g = &groups[target->group];
+	workerGroup *best = cfs_min_group();
+	if (best && best != g && best->vruntime < g->vruntime)
 		return 0;
+	return g->rq.threads == 0 || target->vruntime <= g->rq.arr[0]->vruntime;
+#else
+	return rq.threads == 0 || target->timeQuant <= rq.arr[0]->timeQuant;
+#endif
+}
+
+/* wake a worker taken off a wait list, switching to it directly when
+   the policy allows */
+static void wake_handoff(tcb *target)
+{
+	unblock(target);
+	if (current && handoff_allowed(target))
+		handoff_to(target);
+	else
+		make_ready(target);
+}
+
+/* take a READY worker off the run queue */
+static int ready_remove(tcb *t)
+{
+#if defined(MLFQ)
+	return removeNode(&mlfq[t->priority], t->tID);
+#elif defined(CFS)
+	return removeNode(&groups[t->group].rq, t->tID);
+#else
+	return removeNode(&rq, t->tID);
+#endif
+}
+
+/* directed yield */
+int worker_yield_to(worker_t thread)
+{
+	if (!current)
+	{
+		return -1;
+	}
+	ENTER_RUNTIME();
+	tcb *target = lookup_tcb(thread);
+	if (!target || target->state == FINISHED)
+	{
+		LEAVE_RUNTIME();
+		return -1;
+	}
+	if (target == current || target->state != READY || ready_remove(target) == -1)
+	{
+		/* nothing to hand to, go through the policy */
+		LEAVE_RUNTIME();
+		return worker_yield();
+	}
+
+	if (handoff_allowed(target))
+	{
+		handoff_to(target);
 	}
 	else
+	{
+		make_ready(target);
+		charge_burst(current);
+		make_ready(current);
+		swapcontext(&current->context, &schedCtx);
+	}
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* park the current worker on a channel's sender or receiver list */
+static void chan_block(minHeap *waiters)
+{
+	charge_burst(current);
+	mark_blocked(current);
+	enqueue(waiters, current);
+	swapcontext(&current->context, &schedCtx);
+}
+
+/* wake every worker on a channel's waiter list */
+static void chan_wake_all(minHeap *waiters)
+{
+	while (waiters->threads != 0)
+		make_ready(dequeue(waiters));
+}
+
+/* copy an element in/out of the ring; caller checked count/capacity */
+static void chan_put(worker_chan_t *ch, const void *elem)
+{
+	int tail = (ch->head + ch->count) % ch->capacity;
+	memcpy(ch->buf + (size_t)tail * ch->elemSize, elem, ch->elemSize);
+	ch->count++;
+}
+
+static void chan_take(worker_chan_t *ch, void *elem)
+{
+	memcpy(elem, ch->buf + (size_t)ch->head * ch->elemSize, ch->elemSize);
+	ch->head = (ch->head + 1) % ch->capacity;
+	ch->count--;
+}
+
+/* initialize a bounded channel */
+int worker_chan_init(worker_chan_t *ch, size_t elemSize, int capacity)
+{
+	if (!ch || elemSize == 0 || capacity <= 0)
+	{
+		return -1;
+	}
+	memset(ch, 0, sizeof(*ch));
+	ch->buf = malloc(elemSize * capacity);
+	if (!ch->buf)
 	{
 		return -1;
 	}
+	ch->elemSize = elemSize;
+	ch->capacity = capacity;
+
+	return 0;
 };
 
-/* aquire the mutex lock */
-int worker_mutex_lock(worker_mutex_t *mutex)
+/* send one element; a waiting receiver gets the CPU right away */
+int worker_chan_send(worker_chan_t *ch, const void *elem)
 {
-	// - use the built-in test-and-set atomic function to test the mutex
-	while (__atomic_test_and_set(&mutex->locked, __ATOMIC_SEQ_CST))
+	/* the caller may block before any worker exists */
+	worker_runtime_init();
+	ENTER_RUNTIME();
+	while (ch->count == ch->capacity && !ch->closed)
 	{
-		current->state = BLOCKED;
-		removeNode(&rq, current->tID);
-		enqueue(&mutex->blockList, current);
-		setcontext(&schedCtx);
+		chan_block(&ch->senders);
+	}
+	if (ch->closed)
+	{
+		LEAVE_RUNTIME();
+		return -1;
 	}
+
+	chan_put(ch, elem);
+	if (ch->receivers.threads != 0)
+	{
+		wake_handoff(dequeue(&ch->receivers));
+	}
+
+	LEAVE_RUNTIME();
 	return 0;
 };
 
-/* release the mutex lock */
-int worker_mutex_unlock(worker_mutex_t *mutex)
+/* receive one element; a waiting sender gets the CPU right away */
+int worker_chan_recv(worker_chan_t *ch, void *elem)
 {
-	__atomic_clear(&mutex->locked, __ATOMIC_SEQ_CST);
-	if (mutex->blockList.threads != 0)
+	/* the caller may block before any worker exists */
+	worker_runtime_init();
+	ENTER_RUNTIME();
+	while (ch->count == 0 && !ch->closed)
 	{
-		tcb *pop = dequeue(&mutex->blockList);
-		pop->state = READY;
-		enqueue(&rq, pop);
+		chan_block(&ch->receivers);
+	}
+	if (ch->count == 0)
+	{
+		LEAVE_RUNTIME();
+		return -1;
+	}
+
+	chan_take(ch, elem);
+	if (ch->senders.threads != 0)
+	{
+		wake_handoff(dequeue(&ch->senders));
 	}
 
+	LEAVE_RUNTIME();
 	return 0;
 };
 
-/* destroy the mutex */
-int worker_mutex_destroy(worker_mutex_t *mutex)
+/* send without blocking; woken receivers just become ready, so a
+   producer can fill the buffer in one go */
+int worker_chan_try_send(worker_chan_t *ch, const void *elem)
 {
-	if (mutex->locked == 1)
+	ENTER_RUNTIME();
+	if (ch->closed)
+	{
+		LEAVE_RUNTIME();
+		return -1;
+	}
+	if (ch->count == ch->capacity)
+	{
+		LEAVE_RUNTIME();
+		return 1;
+	}
+
+	chan_put(ch, elem);
+	if (ch->receivers.threads != 0)
+	{
+		make_ready(dequeue(&ch->receivers));
+	}
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* receive without blocking */
+int worker_chan_try_recv(worker_chan_t *ch, void *elem)
+{
+	ENTER_RUNTIME();
+	if (ch->count == 0)
+	{
+		LEAVE_RUNTIME();
+		return ch->closed ? -1 : 1;
+	}
+
+	chan_take(ch, elem);
+	if (ch->senders.threads != 0)
+	{
+		make_ready(dequeue(&ch->senders));
+	}
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* close the channel; receivers still drain what is buffered */
+int worker_chan_close(worker_chan_t *ch)
+{
+	ENTER_RUNTIME();
+	if (ch->closed)
 	{
+		LEAVE_RUNTIME();
 		return -1;
 	}
-	if (mutex->blockList.threads != 0)
+	ch->closed = 1;
+	chan_wake_all(&ch->senders);
+	chan_wake_all(&ch->receivers);
+
+	LEAVE_RUNTIME();
+	return 0;
+};
+
+/* destroy the channel */
+int worker_chan_destroy(worker_chan_t *ch)
+{
+	if (ch->senders.threads != 0 || ch->receivers.threads != 0)
 	{
 		return -1;
 	}
-	free(mutex);
+	free(ch->buf);
+	free(ch->senders.arr);
+	free(ch->receivers.arr);
+	memset(ch, 0, sizeof(*ch));
 
 	return 0;
 };
@@ -178,20 +2330,24 @@ static void sched_psjf()
 {
     if (current) {
         if (current->state == RUNNING) {
+            charge_burst(current);
             current->state = READY;
             enqueue(&rq, current);
             current = NULL;
         } else if (current->state == FINISHED) {
             // DEALLOCATE FINSIHED THREAD
-            if (current->stack) { free(current->stack); current->stack = NULL; }
+            reap_finished(current);
             current = NULL;
         } else {
             current = NULL;
         }
     }
 
-    // PICK NEW THREAD WITH SMALLEST QUANTUM
+    // PICK NEW THREAD WITH SMALLEST PREDICTED BURST
     tcb *next = dequeue(&rq);
+    while (!next && sched_idle()) {
+        next = dequeue(&rq);
+    }
     if (!next) {
         /* no runnable thread */
         return;
@@ -199,13 +2355,21 @@ static void sched_psjf()
 
     //SCHEDULE NEW CONTEXT
     next->state = RUNNING;
+    next->dispatchTime = now_usec();
     current = next;
+    metrics_worker(next);
 
     //ITERATE CONTEXT SWITCH
     tot_cntx_switches++;
 
+    /* ARM PREEMPTION WITH THE TUNED SLICE */
+    tune_quantum();
+    arm_timer(sliceUsec);
+
     /* switch to the chosen thread context; when it yields/exits/preempted control returns here */
     //SWITCH TO NEW CONTEXT
+    place_worker(next);
+    stack_claim(next);
     if (swapcontext(&schedCtx, &next->context) == -1) {
         perror("swapcontext in sched_psjf");
         exit(1);
@@ -213,14 +2377,56 @@ static void sched_psjf()
 }
 
 static void init_mlfq(){
+	static int initialized = 0;
+	if (initialized) return;
+	initialized = 1;
 	for(int i=0; i<NUMQUEUES; i++){
-		initHeap(&mlfq[i], 50); 
+		if (!mlfq[i].arr) initHeap(&mlfq[i], 50); 
 	}
 }
 
 
 
 
+/* Rule 5: every MLFQ_BOOST_PERIOD_US move all workers to the top level,
+   so CPU hogs that became interactive again are not stuck at the bottom */
+static void mlfq_boost(void)
+{
+	static long lastBoost = 0;
+	long now = now_usec();
+	if (lastBoost == 0)
+		lastBoost = now;
+	if (now - lastBoost < MLFQ_BOOST_PERIOD_US)
+		return;
+	lastBoost = now;
+	tot_global_boosts++;
+
+	for (int lvl = 1; lvl < NUMQUEUES; lvl++)
+	{
+		tcb *t;
+		while ((t = dequeue(&mlfq[lvl])) != NULL)
+		{
+			t->priority = 0;
+			t->allotUsed = 0;
+			mlfq_enqueue(t);
+		}
+	}
+	/* running and blocked workers keep no queue position, just move them */
+	for (int i = 0; i < tcbTableSize; i++)
+	{
+		tcb *t = tcbTable[i];
+		if (!t || t->state == FINISHED)
+			continue;
+		if (t->state == BLOCKED)
+		{
+			numBlocked[t->priority]--;
+			numBlocked[0]++;
+		}
+		t->priority = 0;
+		t->allotUsed = 0;
+	}
+}
+
 /* Preemptive MLFQ scheduling algorithm */
 static void sched_mlfq()
 {
@@ -235,44 +2441,34 @@ static void sched_mlfq()
 	// Step4: Apply RR on the topmost queue with entries and run next thread
   /* Behavior:
        - Each mlfq[level] is treated as a runqueue (we use your minHeap array).
-       - For a thread at level L we give timeslice = (1 << L) * 1 QUANTUM (i.e., 2^L quantums).
-       - If a thread uses up its timeslice it is demoted (priority++), unless already at lowest level.
-       - If a thread yields before its timeslice exhausted it stays at same level.
+       - A thread at level L has an allotment of MLFQ_ALLOT_US << L of CPU time.
+         charge_burst adds up what it uses across slices, yields and blocking,
+         so giving up the CPU just before the timer does not reset it.
+       - If a thread uses up its allotment it is demoted (priority++) in charge_burst,
+         unless already at lowest level.
+       - A thread woken from blocking moves up MLFQ_WAKE_BOOST levels (wake_boost).
+       - Every MLFQ_BOOST_PERIOD_US all threads go back to the top level (Rule 5).
     */
 
    init_mlfq(); 
 
+    /* PERIODIC GLOBAL BOOST (Step3) */
+    mlfq_boost();
+
     //CHECKING FOR CURRENT THREAD
     if (current) {
         if (current->state == RUNNING) {
-            if (current->pc > 0) {
-                current->pc -= 1;
-                if (current->pc > 0) {
-                    /* PUT BACK IN PRIORITY QUEUE */
-                    current->state = READY;
-                    if (current->priority < 0) current->priority = 0;
-                    if (current->priority >= NUMQUEUES) current->priority = NUMQUEUES-1;
-                    enqueue(&mlfq[current->priority], current);
-                } else {
-                    /* DEMOTE DUE TO TIMESLICE EXHAUSTION*/
-                    if (current->priority < NUMQUEUES - 1)
-                        current->priority += 1;
-                    current->state = READY;
-                    /* RESET PC */
-                    current->pc = 0;
-                    enqueue(&mlfq[current->priority], current);
-                }
-            } else {
-                // PROGRAM COUNTER = 0 case
-                current->state = READY;
-                if (current->priority < 0) current->priority = 0;
-                if (current->priority >= NUMQUEUES) current->priority = NUMQUEUES-1;
-                enqueue(&mlfq[current->priority], current);
-            }
+            /* DEMOTES ON ALLOTMENT EXHAUSTION (Step1/2.1) */
+            charge_burst(current);
+            if (current->priority < 0) current->priority = 0;
+            if (current->priority >= NUMQUEUES) current->priority = NUMQUEUES-1;
+            /* PUT BACK IN PRIORITY QUEUE (Step2.2) */
+            current->state = READY;
+            mlfq_enqueue(current);
             current = NULL;
         } else if (current->state == FINISHED) {
             //DEALLOCATION 
-            if (current->stack) { free(current->stack); current->stack = NULL; }
+            reap_finished(current);
             current = NULL;
         } else {
             /* BLOCKED/READY */
@@ -283,9 +2479,11 @@ static void sched_mlfq()
 
     //FINDING HIGHEST PRIOTIRTY NON-EMPTY QUEUE
     int chosen_level = -1;
-    for (int lvl = 0; lvl < NUMQUEUES; ++lvl) {
-        if (mlfq[lvl].threads > 0) { chosen_level = lvl; break; }
-    }
+    do {
+        for (int lvl = 0; lvl < NUMQUEUES; ++lvl) {
+            if (mlfq[lvl].threads > 0) { chosen_level = lvl; break; }
+        }
+    } while (chosen_level == -1 && sched_idle());
     if (chosen_level == -1) {
         return;
     }
@@ -295,19 +2493,22 @@ static void sched_mlfq()
     if (!next) return;
 
     
-    //DETERMINING TIMESLICE
-    int timeslice_quanta = 1 << chosen_level;
-    if (timeslice_quanta <= 0) timeslice_quanta = 1;
-
     next->priority = chosen_level;
-    next->pc = timeslice_quanta; /* remaining quantums for its current timeslice */
     next->state = RUNNING;
+    next->dispatchTime = now_usec();
     current = next;
+    metrics_worker(next);
 
     /* ITERATE CONTEXT SWITCH*/
     tot_cntx_switches++;
 
+    /* ARM PREEMPTION WITH THE TUNED SLICE */
+    tune_quantum();
+    arm_timer(sliceUsec);
+
     /* switch to chosen thread */
+    place_worker(next);
+    stack_claim(next);
     if (swapcontext(&schedCtx, &next->context) == -1) {
         perror("swapcontext in sched_mlfq");
         exit(1);
@@ -320,11 +2521,6 @@ static void sched_mlfq()
 /* Completely fair scheduling algorithm */
 static void sched_cfs()
 {
-	// - your own implementation of CFS
-	// (feel free to modify arguments and return types)
-
-	/* Step-by-step guidances */
-
 	// Step1: Update current thread's vruntime by adding the time it actually ran
 	// Step2: Insert current thread into the runqueue (min heap)
 	// Step3: Pop the runqueue to get the thread with a minimum vruntime
@@ -332,44 +2528,26 @@ static void sched_cfs()
 	// Step5: If the ideal time slice is smaller than minimum_granularity (MIN_SCHED_GRN), use MIN_SCHED_GRN instead
 	// Step5: Setup next time interrupt based on the time slice
 	// Step6: Run the selected thread
-	  /* Behavior:
-       - Each mlfq[level] is treated as a runqueue (we use your minHeap array).
-       - For a thread at level L we give timeslice = (1 << L) * 1 QUANTUM (i.e., 2^L quantums).
-       - If a thread uses up its timeslice it is demoted (priority++), unless already at lowest level.
-       - If a thread yields before its timeslice exhausted it stays at same level.
+	/* Behavior:
+       - Workers belong to fair-share groups (group 0 by default), each with a weight.
+       - charge_burst adds the time a worker ran to its vruntime and, scaled
+         by GROUP_DEFAULT_WEIGHT / weight, to its group's vruntime.
+       - The group with the smallest vruntime is picked first, then its member
+         with the smallest vruntime, so groups share the CPU by weight no
+         matter how many workers each one runs.
+       - The slice (Step4/5) is sliceUsec, which tune_quantum already derives
+         from TARGET_LATENCY, the runnable count and MIN_SCHED_GRN.
     */
 
-    /* If current exists, handle its state first (it was preempted or returned here) */
+    /* PUT THE CURRENT THREAD BACK (Step1/2) */
     if (current) {
         if (current->state == RUNNING) {
-            if (current->pc > 0) {
-                current->pc -= 1;
-                if (current->pc > 0) {
-                    /* PLACE BACK IN PRIORITY QUEUE SET READY */
-                    current->state = READY;
-                    if (current->priority < 0) current->priority = 0;
-                    if (current->priority >= NUMQUEUES) current->priority = NUMQUEUES-1;
-                    enqueue(&mlfq[current->priority], current);
-                } else {
-                    /* DEMOTION DUE TO EXHAUSTED TIME SLICE*/
-                    if (current->priority < NUMQUEUES - 1)
-                        current->priority += 1;
-                    current->state = READY;
-                    /* PC COUNTER RESET */
-                    current->pc = 0;
-                    enqueue(&mlfq[current->priority], current);
-                }
-            } else {
-                /* PC = 0 CASE */
-                current->state = READY;
-                if (current->priority < 0) current->priority = 0;
-                if (current->priority >= NUMQUEUES) current->priority = NUMQUEUES-1;
-                enqueue(&mlfq[current->priority], current);
-            }
+            charge_burst(current);
+            make_ready(current);
             current = NULL;
         } else if (current->state == FINISHED) {
             /* DEALLOCATION */
-            if (current->stack) { free(current->stack); current->stack = NULL; }
+            reap_finished(current);
             current = NULL;
         } else {
             /* BLOCKED OR READY */
@@ -377,37 +2555,34 @@ static void sched_cfs()
         }
     }
 
-    /* FINDING HIGHEST PRIORITY NON EMPTY QUEUE */
-    int chosen_level = -1;
-    for (int lvl = 0; lvl < NUMQUEUES; ++lvl) {
-        if (mlfq[lvl].threads > 0) { chosen_level = lvl; break; }
+    /* LEAST SERVED GROUP, THEN ITS LEAST SERVED WORKER (Step3) */
+    tcb *next = cfs_pick();
+    while (!next && sched_idle()) {
+        next = cfs_pick();
     }
-    if (chosen_level == -1) {
+    if (!next) {
         return;
     }
 
-    /* TAKE NEXT FROM LEVELS HEAP */
-    tcb *next = dequeue(&mlfq[chosen_level]);
-    if (!next) return;
-
-    /* DETERMINE TIMESLICE */
-    int timeslice_quanta = 1 << chosen_level;
-    if (timeslice_quanta <= 0) timeslice_quanta = 1;
-
-    next->priority = chosen_level;
-    next->pc = timeslice_quanta; /* remaining quantums for its current timeslice */
     next->state = RUNNING;
+    next->dispatchTime = now_usec();
     current = next;
+    metrics_worker(next);
 
     /* ITERATE CONTEXT SWITCH */
     tot_cntx_switches++;
 
-    /* SWITCH TO NEW CHOSEN THREAD */
+    /* ARM PREEMPTION WITH THE TUNED SLICE */
+    tune_quantum();
+    arm_timer(sliceUsec);
+
+    /* SWITCH TO NEW CHOSEN THREAD (Step6) */
+    place_worker(next);
+    stack_claim(next);
     if (swapcontext(&schedCtx, &next->context) == -1) {
-        perror("swapcontext in sched_mlfq");
+        perror("swapcontext in sched_cfs");
         exit(1);
     }
-
 }
 
 
@@ -422,25 +2597,16 @@ static void schedule()
 	struct itimerval timerOff = {0};	
     memset(&timerOff, 0, sizeof(timerOff));
     setitimer(ITIMER_VIRTUAL, &timerOff, NULL); 
+    schedEnterNs = now_nsec();
+    ENTER_RUNTIME();
+    preemptPending = 0;
 
-    //CHECKING IF CURRENT THREAD IS YIELDED 
-    if(current){
-        if (current->state == RUNNING){
-            current->state = READY;
-            enqueue(&rq, current); 
-        }
-        else if(current->state == FINISHED){
-            if(current->stack){
-                free(current->stack);
-                current->stack = NULL;
-            }
-            current = NULL; 
-        }
-        else{
-            current = NULL; 
-        }
-    }
+    //PICK UP WAKEUPS POSTED BY OTHER KERNEL THREADS, AND EXPIRED TIMED WAITS
+    drain_wakeups();
+    expire_waits();
+    metrics_publish();
 
+    // the policy puts the current thread back (burst accounting, demotion)
 
     // - invoke scheduling algorithms according to the policy (PSJF or MLFQ or CFS)
 #if defined(PSJF)
@@ -456,6 +2622,676 @@ static void schedule()
 
 }
 
+// -----------------------------------------------------------------------------
+// Live metrics
+// -----------------------------------------------------------------------------
+
+static void metrics_atexit(void)
+{
+	worker_metrics_close();
+}
+
+/* create /dev/shm/thread-worker.<pid> and start publishing into it */
+int worker_metrics_open(void)
+{
+	if (metrics)
+	{
+		return 0;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), METRICS_SHM_FMT, (int)getpid());
+	int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror("worker_metrics_open");
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(workerMetrics)) < 0)
+	{
+		perror("worker_metrics_open");
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	void *seg = mmap(NULL, sizeof(workerMetrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED)
+	{
+		perror("worker_metrics_open");
+		shm_unlink(name);
+		return -1;
+	}
+
+	workerMetrics *m = seg;
+	memset(m, 0, sizeof(*m));
+	m->version = METRICS_VERSION;
+	m->pid = (int)getpid();
+	m->levels = NUMQUEUES;
+	for (int i = 0; i < METRICS_MAX_WORKERS; i++)
+		m->workers[i].tID = -1;
+	__atomic_store_n(&m->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+
+	metrics = m;
+	for (int i = 0; i < tcbTableSize; i++)
+	{
+		if (tcbTable[i])
+			metrics_worker(tcbTable[i]);
+	}
+	metrics_publish();
+
+	static int registered = 0;
+	if (!registered)
+	{
+		registered = 1;
+		atexit(metrics_atexit);
+	}
+	return 0;
+}
+
+/* stop publishing and remove the segment */
+void worker_metrics_close(void)
+{
+	if (!metrics)
+		return;
+
+	char name[64];
+	snprintf(name, sizeof(name), METRICS_SHM_FMT, metrics->pid);
+	munmap(metrics, sizeof(workerMetrics));
+	metrics = NULL;
+	shm_unlink(name);
+}
+
+// -----------------------------------------------------------------------------
+// Sampling profiler
+// -----------------------------------------------------------------------------
+
+/* end of the stack sp is on: the scheduler's, the running worker's or
+   the kernel thread's own; NULL if it is none of them */
+static char *prof_stack_top(char *sp)
+{
+	if (schedStack && sp >= (char *)schedStack && sp < (char *)schedStack + SCHED_STACK_SIZE)
+		return (char *)schedStack + SCHED_STACK_SIZE;
+	if (current)
+	{
+		char *base = current->context.uc_stack.ss_sp;
+		size_t size = current->context.uc_stack.ss_size;
+		if (base && sp >= base && sp < base + size)
+			return base + size;
+	}
+	if (sp >= profThreadStack[0] && sp < profThreadStack[1])
+		return profThreadStack[1];
+	return NULL;
+}
+
+/* SIGPROF: record which worker is on the CPU and its user stack. Only
+   reads registers and memory, since backtrace() and the unwinder are not
+   async-signal-safe: the interrupted pc, then the frame pointer chain as
+   far as it stays on the interrupted stack. Frames built without a frame
+   pointer (libc) end the chain or skip their caller. */
+static void prof_handler(int signum, siginfo_t *info, void *ucontext)
+{
+	int saved = errno;
+	int idx = __atomic_fetch_add(&numProfSamples, 1, __ATOMIC_RELAXED);
+	if (idx >= PROF_MAX_SAMPLES)
+	{
+		numProfSamples = PROF_MAX_SAMPLES;
+		profDropped++;
+		errno = saved;
+		return;
+	}
+
+	profSample *sample = &profSamples[idx];
+	ucontext_t *uc = ucontext;
+	char *sp = context_sp(uc);
+	uintptr_t pc, fp;
+#if defined(__x86_64__)
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__i386__)
+	pc = uc->uc_mcontext.gregs[REG_EIP];
+	fp = uc->uc_mcontext.gregs[REG_EBP];
+#elif defined(__aarch64__)
+	pc = uc->uc_mcontext.pc;
+	fp = uc->uc_mcontext.regs[29];
+#else
+	pc = 0;
+	fp = 0;
+#endif
+	if (schedStack && sp >= (char *)schedStack && sp < (char *)schedStack + SCHED_STACK_SIZE)
+		sample->tID = -1;
+	else
+		sample->tID = current ? current->tID : -1;
+
+	int depth = 0;
+	if (pc)
+		sample->pc[depth++] = (void *)pc;
+	/* a frame record is { caller's frame pointer, return address } */
+	char *top = prof_stack_top(sp);
+	while (top && depth < PROF_MAX_DEPTH && fp % sizeof(uintptr_t) == 0 &&
+		   (char *)fp >= sp && (char *)fp + 2 * sizeof(uintptr_t) <= top)
+	{
+		uintptr_t *frame = (uintptr_t *)fp;
+		if (!frame[1])
+			break;
+		sample->pc[depth++] = (void *)frame[1];
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+	sample->depth = depth;
+	errno = saved;
+}
+
+/* start sampling the running worker hz times per CPU second */
+int worker_prof_start(int hz)
+{
+	if (hz <= 0 || hz > 1000000)
+	{
+		return -1;
+	}
+	if (!profSamples)
+	{
+		profSamples = malloc(sizeof(profSample) * PROF_MAX_SAMPLES);
+		if (!profSamples)
+		{
+			return -1;
+		}
+	}
+	numProfSamples = 0;
+	profDropped = 0;
+
+	/* bounds for walking the frames of whoever runs on the thread's stack */
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0)
+	{
+		void *lo;
+		size_t size;
+		if (pthread_attr_getstack(&attr, &lo, &size) == 0)
+		{
+			profThreadStack[0] = lo;
+			profThreadStack[1] = (char *)lo + size;
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = &prof_handler;
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigaction(SIGPROF, &sa, NULL);
+
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = hz == 1 ? 999999 : 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+
+	return 0;
+}
+
+/* order samples by worker */
+static int prof_compare(const void *a, const void *b)
+{
+	const profSample *x = a, *y = b;
+	return (x->tID > y->tID) - (x->tID < y->tID);
+}
+
+static int prof_compare_lines(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* print one frame as function name, or module+offset without symbols
+   (link with -rdynamic to get names for the executable) */
+static void prof_frame(FILE *out, void *pc)
+{
+	Dl_info info;
+	if (dladdr(pc, &info) && info.dli_sname)
+		fprintf(out, "%s", info.dli_sname);
+	else if (info.dli_fname)
+	{
+		const char *base = strrchr(info.dli_fname, '/');
+		fprintf(out, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+				(unsigned long)((char *)pc - (char *)info.dli_fbase));
+	}
+	else
+		fprintf(out, "%p", pc);
+}
+
+/* stop sampling and write the folded stacks */
+int worker_prof_stop(const char *path)
+{
+	struct itimerval timerOff;
+	memset(&timerOff, 0, sizeof(timerOff));
+	setitimer(ITIMER_PROF, &timerOff, NULL);
+	signal(SIGPROF, SIG_IGN);
+
+	if (!profSamples)
+	{
+		return -1;
+	}
+	int n = numProfSamples;
+	numProfSamples = 0;
+
+	/* per-worker totals */
+	qsort(profSamples, n, sizeof(profSample), prof_compare);
+	for (int i = 0; i < n;)
+	{
+		int j = i;
+		while (j < n && profSamples[j].tID == profSamples[i].tID)
+			j++;
+		if (profSamples[i].tID < 0)
+			fprintf(stderr, "Profile scheduler %d samples \n", j - i);
+		else
+			fprintf(stderr, "Profile worker %d %d samples \n", profSamples[i].tID, j - i);
+		i = j;
+	}
+	if (profDropped)
+		fprintf(stderr, "Profile dropped %ld samples \n", profDropped);
+
+	/* symbolize every sample, outermost frame first, then merge equal
+	   lines: different pcs in the same functions fold together */
+	char **lines = malloc(sizeof(char *) * (n ? n : 1));
+	if (!lines)
+	{
+		return -1;
+	}
+	for (int i = 0; i < n; i++)
+	{
+		size_t len;
+		FILE *line = open_memstream(&lines[i], &len);
+		profSample *sample = &profSamples[i];
+		if (sample->tID < 0)
+			fprintf(line, "scheduler");
+		else
+			fprintf(line, "worker-%d", sample->tID);
+		for (int d = sample->depth - 1; d >= 0; d--)
+		{
+			fputc(';', line);
+			prof_frame(line, sample->pc[d]);
+		}
+		fclose(line);
+	}
+	qsort(lines, n, sizeof(char *), prof_compare_lines);
+
+	FILE *out = fopen(path, "w");
+	if (!out)
+	{
+		perror("worker_prof_stop");
+	}
+	for (int i = 0; i < n;)
+	{
+		int j = i + 1;
+		while (j < n && strcmp(lines[i], lines[j]) == 0)
+			j++;
+		if (out)
+			fprintf(out, "%s %d\n", lines[i], j - i);
+		for (int k = i; k < j; k++)
+			free(lines[k]);
+		i = j;
+	}
+	free(lines);
+
+	if (!out)
+	{
+		return -1;
+	}
+	fclose(out);
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Mutex profiler
+// -----------------------------------------------------------------------------
+
+/* Statistics record of a mutex, created on first use. Called inside the
+   runtime on the workers' kernel thread; the push is atomic too, since
+   another kernel thread may initialize a mutex at the same time. */
+static mutexProf *mutex_prof(worker_mutex_t *mutex, void *site)
+{
+	if (!mutex->prof)
+	{
+		mutexProf *p = calloc(1, sizeof(mutexProf));
+		if (!p)
+			return NULL;
+		p->mutex = mutex;
+		p->site = site;
+		p->next = __atomic_load_n(&lockProfs, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&lockProfs, &p->next, p, 1,
+											__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		mutex->prof = p;
+	}
+	return mutex->prof;
+}
+
+/* the caller holds the mutex now; waitStart is 0 if it did not block */
+static void mutex_prof_acquired(worker_mutex_t *mutex, long waitStart, void *site)
+{
+	mutexProf *p = mutex_prof(mutex, site);
+	if (!p)
+		return;
+	long now = now_nsec();
+	p->acquired++;
+	p->acquiredAt = now;
+	if (!waitStart)
+		return;
+
+	long wait = now - waitStart;
+	p->contended++;
+	p->waitNs += wait;
+	if (wait > p->maxWaitNs)
+		p->maxWaitNs = wait;
+
+	/* keep the LOCK_PROF_SITES call sites with the longest waits */
+	lockSite *slot = NULL;
+	for (int i = 0; i < LOCK_PROF_SITES && !slot; i++)
+	{
+		if (p->worst[i].pc == site)
+			slot = &p->worst[i];
+	}
+	if (!slot)
+	{
+		/* replace the shortest wait; empty slots have none */
+		slot = &p->worst[0];
+		for (int i = 1; i < LOCK_PROF_SITES; i++)
+		{
+			if (p->worst[i].waitNs < slot->waitNs)
+				slot = &p->worst[i];
+		}
+		if (slot->pc && wait <= slot->waitNs)
+			return;
+		slot->pc = site;
+		slot->waitNs = 0;
+	}
+	if (wait > slot->waitNs)
+		slot->waitNs = wait;
+}
+
+/* start recording per-mutex statistics */
+int worker_mutex_prof_start(void)
+{
+	lockProfOn = 1;
+	return 0;
+}
+
+/* most wasted time first */
+static int lock_prof_compare(const void *a, const void *b)
+{
+	const mutexProf *x = *(const mutexProf **)a;
+	const mutexProf *y = *(const mutexProf **)b;
+	if (x->waitNs != y->waitNs)
+		return x->waitNs < y->waitNs ? 1 : -1;
+	if (x->holdNs != y->holdNs)
+		return x->holdNs < y->holdNs ? 1 : -1;
+	return 0;
+}
+
+static int lock_site_compare(const void *a, const void *b)
+{
+	const lockSite *x = a, *y = b;
+	return (x->waitNs < y->waitNs) - (x->waitNs > y->waitNs);
+}
+
+/* write the mutexes ranked by the time workers waited for them */
+int worker_mutex_prof_report(const char *path)
+{
+	int n = 0;
+	for (mutexProf *p = lockProfs; p; p = p->next)
+		n++;
+	mutexProf **ranked = malloc((n ? n : 1) * sizeof(mutexProf *));
+	if (!ranked)
+	{
+		return -1;
+	}
+	n = 0;
+	for (mutexProf *p = lockProfs; p; p = p->next)
+		ranked[n++] = p;
+	qsort(ranked, n, sizeof(mutexProf *), lock_prof_compare);
+
+	FILE *out = path ? fopen(path, "w") : stderr;
+	if (!out)
+	{
+		perror(path);
+		free(ranked);
+		return -1;
+	}
+
+	fprintf(out, "%-4s %-18s %10s %9s %12s %10s %12s %10s  %s\n", "rank", "mutex", "acquired",
+			"contend%", "wait_us", "max_wait", "hold_us", "max_hold", "site");
+	for (int i = 0; i < n; i++)
+	{
+		mutexProf *p = ranked[i];
+		fprintf(out, "%-4d %-18p %10ld %8.1f%% %12ld %10ld %12ld %10ld  ", i + 1, p->mutex,
+				p->acquired, p->acquired ? 100.0 * p->contended / p->acquired : 0.0,
+				p->waitNs / 1000, p->maxWaitNs / 1000, p->holdNs / 1000, p->maxHoldNs / 1000);
+		if (p->site)
+			prof_frame(out, p->site);
+		fprintf(out, "%s\n", p->destroyed ? " (destroyed)" : "");
+
+		qsort(p->worst, LOCK_PROF_SITES, sizeof(lockSite), lock_site_compare);
+		for (int j = 0; j < LOCK_PROF_SITES && p->worst[j].pc; j++)
+		{
+			fprintf(out, "       waited %ld us at ", p->worst[j].waitNs / 1000);
+			prof_frame(out, p->worst[j].pc);
+			fprintf(out, "\n");
+		}
+	}
+
+	if (out != stderr)
+		fclose(out);
+	free(ranked);
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+// CPU topology and placement
+// -----------------------------------------------------------------------------
+
+static int read_sys_int(const char *path, int *value)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+	int ok = fscanf(f, "%d", value) == 1;
+	fclose(f);
+	return ok ? 0 : -1;
+}
+
+/* read /sys/devices/system/cpu once; CPUs without topology files are offline */
+static void topo_load(void)
+{
+	if (topoLoaded)
+		return;
+	topoLoaded = 1;
+
+	char path[128];
+	for (int cpu = 0; cpu < MAX_CORES; cpu++)
+	{
+		cpuTopo *c = &topo[cpu];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		if (read_sys_int(path, &c->core) == -1)
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		if (read_sys_int(path, &c->package) == -1)
+			c->package = 0;
+
+		/* the highest cache level is the one shared across cores */
+		int bestLevel = -1;
+		c->llc = -1;
+		for (int idx = 0; idx < 8; idx++)
+		{
+			int level, id;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, idx);
+			if (read_sys_int(path, &level) == -1)
+				break;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/id", cpu, idx);
+			if (level > bestLevel && read_sys_int(path, &id) == 0)
+			{
+				bestLevel = level;
+				c->llc = id;
+			}
+		}
+		c->online = 1;
+	}
+
+	if (sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) == -1)
+	{
+		CPU_ZERO(&allowedCpus);
+		for (int cpu = 0; cpu < MAX_CORES; cpu++)
+		{
+			if (topo[cpu].online)
+				CPU_SET(cpu, &allowedCpus);
+		}
+	}
+}
+
+/* "0-3,8" -> set; returns the number of CPUs or -1 */
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	const char *p = list;
+	while (*p)
+	{
+		char *end;
+		long lo = strtol(p, &end, 10), hi = lo;
+		if (end == p)
+			return -1;
+		p = end;
+		if (*p == '-')
+		{
+			p++;
+			hi = strtol(p, &end, 10);
+			if (end == p)
+				return -1;
+			p = end;
+		}
+		if (lo < 0 || hi < lo || hi >= MAX_CORES)
+			return -1;
+		for (long cpu = lo; cpu <= hi; cpu++)
+			CPU_SET(cpu, set);
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+	return CPU_COUNT(set);
+}
+
+/* pin the runtime's kernel thread to cpulist */
+int worker_set_cpus(const char *cpulist)
+{
+	cpu_set_t set;
+	topo_load();
+	if (!cpulist || parse_cpulist(cpulist, &set) <= 0)
+	{
+		return -1;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+	{
+		return -1;
+	}
+	allowedCpus = set;
+	placedCpu = -1;
+	return 0;
+}
+
+int worker_cpu_distance(int a, int b)
+{
+	topo_load();
+	if (a < 0 || b < 0 || a >= MAX_CORES || b >= MAX_CORES || !topo[a].online || !topo[b].online)
+	{
+		return -1;
+	}
+	if (a == b)
+		return 0;
+	if (topo[a].package != topo[b].package)
+		return 4;
+	if (topo[a].core == topo[b].core)
+		return 1;
+	if (topo[a].llc >= 0 && topo[a].llc == topo[b].llc)
+		return 2;
+	return 3;
+}
+
+/* CPUs without topology (offline hint, no /sys) sort after the rest */
+static int cpu_distance_or_far(int a, int b)
+{
+	int d = worker_cpu_distance(a, b);
+	if (d < 0)
+		return a == b ? 0 : 5;
+	return d;
+}
+
+/* allowed CPUs, nearest to cpu first */
+int worker_near_cpus(int cpu, int *order, int max)
+{
+	topo_load();
+	int n = 0;
+	for (int c = 0; c < MAX_CORES && n < max; c++)
+	{
+		if (!CPU_ISSET(c, &allowedCpus))
+			continue;
+		/* insertion sort by distance; ties keep CPU order */
+		int d = cpu_distance_or_far(cpu, c), i = n++;
+		while (i > 0 && cpu_distance_or_far(cpu, order[i - 1]) > d)
+		{
+			order[i] = order[i - 1];
+			i--;
+		}
+		order[i] = c;
+	}
+	return n;
+}
+
+/* create a worker that runs on cpu, or the nearest allowed one */
+int worker_create_on(worker_t *thread, int cpu, pthread_attr_t *attr,
+					 void *(*function)(void *), void *arg)
+{
+	worker_runtime_init();
+	if (cpu >= 0)
+	{
+		int near;
+		if (worker_near_cpus(cpu, &near, 1) != 1)
+		{
+			return -1;
+		}
+		cpu = near;
+	}
+	return create_worker(thread, 0, cpu, attr, function, arg);
+}
+
+/* Move the runtime's kernel thread to the CPU the next worker asked for,
+   or give it all of allowedCpus back for a worker without a hint. Every
+   worker shares this one thread, so placement picks where it runs, not
+   how many cores run at once. Only a change of mask costs a syscall. */
+static void place_worker(tcb *t)
+{
+	if (t->cpu >= 0 && !CPU_ISSET(t->cpu, &allowedCpus))
+	{
+		/* worker_set_cpus dropped its CPU since: settle on the nearest */
+		int near;
+		t->cpu = worker_near_cpus(t->cpu, &near, 1) == 1 ? near : -1;
+	}
+	if (t->cpu == placedCpu)
+		return;
+
+	cpu_set_t one;
+	cpu_set_t *mask = &allowedCpus;
+	if (t->cpu >= 0)
+	{
+		CPU_ZERO(&one);
+		CPU_SET(t->cpu, &one);
+		mask = &one;
+	}
+	if (sched_setaffinity(0, sizeof(cpu_set_t), mask) == 0 && t->cpu >= 0)
+		tot_migrations++;
+	/* on failure too, or every switch to t would retry it */
+	placedCpu = t->cpu;
+}
+
 // DO NOT MODIFY THIS FUNCTION
 /* Function to print global statistics. Do not modify this function.*/
 void print_app_stats(void)
@@ -466,13 +3302,42 @@ void print_app_stats(void)
 	fprintf(stderr, "Average response time  %lf \n", avg_resp_time);
 }
 
-int initHeap(minHeap *h, int capacity) {
-    h->arr = malloc(sizeof(tcb*) * capacity);
-    if (!h->arr) {
-        return -1;
-    }
-    h->threads = 0;
-    h->threshold = capacity;
-	return 0;
+/* Function to print scheduler statistics beyond print_app_stats */
+void print_sched_stats(void)
+{
+	fprintf(stderr, "Preemptions %ld \n", tot_preemptions);
+	fprintf(stderr, "Direct handoffs %ld \n", tot_handoffs);
+	if (tot_wake_boosts || tot_global_boosts)
+		fprintf(stderr, "MLFQ boosts %ld on wakeup, %ld global \n", tot_wake_boosts, tot_global_boosts);
+	fprintf(stderr, "Switch cost %ld ns \n", switchCostNs);
+	fprintf(stderr, "Time slice %ld us (%ld adjustments) \n", sliceUsec, quantumAdjustments);
+	long first = quantumAdjustments > QUANTUM_LOG_SIZE ? quantumAdjustments - QUANTUM_LOG_SIZE : 0;
+	for (long i = first; i < quantumAdjustments; i++)
+	{
+		fprintf(stderr, "  slice adjustment %ld: %ld -> %ld us \n", i + 1,
+				quantumLog[i % QUANTUM_LOG_SIZE][0], quantumLog[i % QUANTUM_LOG_SIZE][1]);
+	}
+	long groupTotal = 0;
+	for (int g = 0; g < MAX_GROUPS; g++)
+		groupTotal += groups[g].cpuTime;
+	for (int g = 0; g < MAX_GROUPS; g++)
+	{
+		if (groups[g].used)
+			fprintf(stderr, "Group %d weight %d cpu %ld us (%.1f%%) \n", g, groups[g].weight,
+					groups[g].cpuTime, groupTotal ? 100.0 * groups[g].cpuTime / groupTotal : 0.0);
+	}
+	if (numSharedStacks > 0 || tot_stack_saves > 0)
+	{
+		fprintf(stderr, "Shared stacks %d, %ld saves, %ld bytes copied (%.0f per switch) \n",
+				numSharedStacks, tot_stack_saves, tot_stack_bytes,
+				tot_cntx_switches ? (double)tot_stack_bytes / tot_cntx_switches : 0.0);
+	}
+	if (tot_migrations)
+		fprintf(stderr, "Placement migrations %ld \n", tot_migrations);
+	fprintf(stderr, "Idle parks %ld \n", idleParks);
+	for (int cpu = 0; cpu < MAX_CORES; cpu++)
+	{
+		if (idleTime[cpu])
+			fprintf(stderr, "Idle time cpu%d %ld us \n", cpu, idleTime[cpu]);
+	}
 }
-
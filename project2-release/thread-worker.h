@@ -22,9 +22,76 @@
 /* Time slice quantum in milliseconds */
 #define QUANTUM 10
 
+/* Bounds for the auto-tuned time slice in microseconds */
+#ifndef QUANTUM_MIN_US
+#define QUANTUM_MIN_US 500
+#endif
+#ifndef QUANTUM_MAX_US
+#define QUANTUM_MAX_US 50000
+#endif
+
+/* Target context switch overhead, in percent of the time slice */
+#ifndef SWITCH_OVERHEAD_PCT
+#define SWITCH_OVERHEAD_PCT 1
+#endif
+
+/* Number of slice adjustments remembered for print_sched_stats */
+#define QUANTUM_LOG_SIZE 8
+
+/* Sampling profiler: deepest stack recorded and sample buffer size */
+#define PROF_MAX_DEPTH 32
+#define PROF_MAX_SAMPLES 65536
+
+/* Size of worker stacks, and how many freed ones are kept for reuse */
+#define WORKER_STACK_SIZE (2048 * 32)
+#ifndef STACK_CACHE_SIZE
+#define STACK_CACHE_SIZE 256
+#endif
+
+/* Mutex profiler: longest-waiting call sites remembered per mutex */
+#define LOCK_PROF_SITES 4
+
+/* Copy-stack mode: size and max number of the shared execution stacks */
+#ifndef SHARED_STACK_SIZE
+#define SHARED_STACK_SIZE (2048 * 32 * 4)
+#endif
+#define MAX_SHARED_STACKS 64
+
+/* Fair-share groups: max number of groups and the weight of group 0 */
+#define MAX_GROUPS 64
+#define GROUP_DEFAULT_WEIGHT 1024
+
+/* MLFQ: CPU time a worker may use on level L before it is demoted is
+   MLFQ_ALLOT_US << L, counted across slices, yields and blocking */
+#ifndef MLFQ_ALLOT_US
+#define MLFQ_ALLOT_US (QUANTUM * 1000)
+#endif
+
+/* MLFQ: levels a worker moves up when it wakes from blocking (0 = off) */
+#ifndef MLFQ_WAKE_BOOST
+#define MLFQ_WAKE_BOOST 1
+#endif
+
+/* MLFQ: period S after which every worker goes back to the top level (usec) */
+#ifndef MLFQ_BOOST_PERIOD_US
+#define MLFQ_BOOST_PERIOD_US 500000
+#endif
+
 /* Number of Queues in Multique Scheduler*/
 #define NUMQUEUES 8
 
+/* Max number of CPUs the runtime tracks (idle time, topology, placement) */
+#define MAX_CORES 64
+
+/* PSJF burst prediction: weight (in percent) given to the most recent burst
+   when updating the exponential average, tau = a*t + (100-a)*tau / 100 */
+#ifndef BURST_ALPHA
+#define BURST_ALPHA 50
+#endif
+
+/* PSJF burst prediction for a worker that has not run yet, in microseconds */
+#define BURST_INITIAL (QUANTUM * 1000)
+
 /* include lib header files that you need here: */
 #include <unistd.h>
 #include <sys/syscall.h>
@@ -32,6 +99,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ucontext.h>
+#include <time.h>
 
 typedef int worker_t;
 
@@ -53,7 +121,28 @@ typedef struct TCB
     int pc;
     struct TCB *next;
     void *retValue;
-    long timeQuant;
+    long timeQuant;     /* heap key: predicted next CPU burst (usec); vruntime
+                           under CFS, enqueue order within a level under MLFQ */
+    long lastBurst;     /* length of the most recent CPU burst (usec) */
+    long dispatchTime;  /* when the worker was last switched in (usec) */
+    void *(*func)(void *);
+    void *arg;
+    struct TCB *joiner; /* worker blocked in worker_join on this one */
+    int waitCount;      /* joiner: workers it still waits for (worker_join_all) */
+    struct tcbBatch *batch; /* worker_create_n allocation the TCB belongs to */
+    int detached;
+    long cpuTime;       /* total CPU time used (usec) */
+    long allotUsed;     /* MLFQ: CPU time used on the current level (usec) */
+    int cpu;            /* placement hint: CPU to run on, -1 for any */
+    int group;          /* fair-share group */
+    long vruntime;      /* CFS: CPU time used, for ordering within the group */
+    int sharedStack;    /* copy-stack mode: shared stack index, -1 for an own stack */
+    int started;        /* copy-stack mode: context made on the shared stack */
+    void *saved;        /* copy-stack mode: used part of the stack while switched out */
+    size_t savedSize;
+    long wakeAt;        /* timed wait: CLOCK_MONOTONIC deadline (nsec), 0 for none */
+    struct MH *waitingOn; /* timed wait: block list the worker sleeps on */
+    int timedOut;       /* timed wait: woken by the deadline, not a signal */
 } tcb;
 
 /* define your data structures here: */
@@ -66,17 +155,57 @@ typedef struct MH
     int threshold;
 } minHeap;
 
+/* fair-share group: CFS picks the group with the smallest vruntime,
+   then the member with the smallest vruntime */
+typedef struct workerGroup
+{
+    int used;
+    int weight;
+    long vruntime;      /* member CPU time scaled by GROUP_DEFAULT_WEIGHT / weight */
+    long minVruntime;   /* largest member vruntime picked so far */
+    long cpuTime;       /* total CPU time of the members (usec) */
+    int members;        /* workers in the group that have not exited */
+    minHeap rq;         /* READY members, keyed by vruntime (CFS only) */
+    tcb *waiter;        /* worker blocked in worker_group_wait */
+    int waitFor;        /* members left when the waiter is woken */
+} workerGroup;
+
 /* mutex struct definition */
 typedef struct worker_mutex_t
 {
-    int locked;
-    struct worker_mutex_t *next;
     minHeap blockList;
+    int type;                   /* PTHREAD_MUTEX_*; where glibc keeps the kind, so
+                                   the preload shim gets static initializers right */
+    int locked;
+    int owner;                  /* recursive/error-checking: holder, 0 if none */
+    int count;                  /* recursive: times the holder locked it */
+    struct mutexProf *prof;     /* contention statistics, NULL unless profiling */
 } worker_mutex_t;
 
-int heapResize(minHeap *h)
+/* condition variable: waiters block on a heap, like mutex waiters */
+typedef struct worker_cond_t
+{
+    minHeap waiters;
+    clockid_t clock;            /* clock of worker_cond_timedwait deadlines */
+    unsigned int seq;           /* bumped by every signal, for waiters on other kernel threads */
+} worker_cond_t;
+
+/* bounded channel: ring buffer of capacity fixed-size elements */
+typedef struct worker_chan_t
+{
+    char *buf;
+    size_t elemSize;
+    int capacity;
+    int head;           /* slot of the oldest element */
+    int count;
+    int closed;
+    minHeap senders;    /* workers blocked on a full channel */
+    minHeap receivers;  /* workers blocked on an empty channel */
+} worker_chan_t;
+
+static inline int heapResize(minHeap *h)
 {
-    int doubleThreshold = h->threshold * 2;
+    int doubleThreshold = h->threshold ? h->threshold * 2 : 16;
     tcb **newArr = realloc(h->arr, doubleThreshold * sizeof(tcb *));
     if (!newArr)
     {
@@ -88,7 +217,30 @@ int heapResize(minHeap *h)
     return 0;
 }
 
-int enqueue(minHeap *h, tcb *node)
+/* make room for n more nodes at once */
+static inline int heapReserve(minHeap *h, int n)
+{
+    if (h->threads + n <= h->threshold)
+    {
+        return 0;
+    }
+    int newThreshold = h->threshold ? h->threshold : 16;
+    while (newThreshold < h->threads + n)
+    {
+        newThreshold *= 2;
+    }
+    tcb **newArr = realloc(h->arr, newThreshold * sizeof(tcb *));
+    if (!newArr)
+    {
+        return -1;
+    }
+
+    h->arr = newArr;
+    h->threshold = newThreshold;
+    return 0;
+}
+
+static inline int enqueue(minHeap *h, tcb *node)
 {
     if (h->threads == h->threshold)
     {
@@ -120,7 +272,7 @@ int enqueue(minHeap *h, tcb *node)
     return 0;
 }
 
-tcb *dequeue(minHeap *h)
+static inline tcb *dequeue(minHeap *h)
 {
     if (h->threads == 0)
         return NULL;
@@ -156,7 +308,7 @@ tcb *dequeue(minHeap *h)
     return minNode;
 }
 
-tcb* searchByTID(minHeap *h, int tID)
+static inline tcb* searchByTID(minHeap *h, int tID)
 {
     for (int i = 0; i < h->threads; i++)
     {
@@ -166,7 +318,7 @@ tcb* searchByTID(minHeap *h, int tID)
     return NULL;  
 }
 
-int removeNode(minHeap *h, int tID)
+static inline int removeNode(minHeap *h, int tID)
 {
     tcb *node = searchByTID(h, tID);
     if (!node)
@@ -228,28 +380,191 @@ int removeNode(minHeap *h, int tID)
 /* create a new thread */
 int worker_create(worker_t *thread, pthread_attr_t *attr, void *(*function)(void *), void *arg);
 
+/* create a fair-share group; returns its id or -1.
+   Group 0 always exists with weight GROUP_DEFAULT_WEIGHT */
+int worker_group_create(int weight);
+
+/* change the weight of a group */
+int worker_group_set_weight(int group, int weight);
+
+/* create a new thread in a fair-share group */
+int worker_create_group(worker_t *thread, int group, pthread_attr_t *attr,
+                        void *(*function)(void *), void *arg);
+
+/* Copy-stack mode: workers created after this call run on n shared
+   stacks (0 turns it off again). Only the used part of a stack is saved
+   when another worker needs it, so an idle worker costs its TCB plus a
+   right-sized copy of its stack. Pointers into a worker's stack are not
+   valid while it is switched out. Also enabled with WORKER_SHARED_STACKS=n */
+int worker_shared_stacks(int n);
+
+/* pin the runtime's kernel thread to the CPUs in cpulist ("0-3,8"),
+   also done with WORKER_CPUS=cpulist */
+int worker_set_cpus(const char *cpulist);
+
+/* create a new thread that runs on cpu, or on the nearest allowed CPU
+   when cpu is not in the worker_set_cpus list; -1 for no preference.
+   Give workers that share data the same or nearby CPUs. All workers run
+   on one kernel thread, which moves to the CPU of each placed worker it
+   switches to (and back to the whole list for the others): placement
+   keeps a worker's cache warm, it never runs two workers at once */
+int worker_create_on(worker_t *thread, int cpu, pthread_attr_t *attr,
+                     void *(*function)(void *), void *arg);
+
+/* topology distance between two CPUs: 0 same CPU, 1 SMT siblings,
+   2 shared last-level cache, 3 same package, 4 other package, -1 unknown */
+int worker_cpu_distance(int a, int b);
+
+/* the allowed CPUs ordered nearest first from cpu (the order to look for
+   work or a free core in); returns how many were stored in order */
+int worker_near_cpus(int cpu, int *order, int max);
+
+/* create n threads running function, thread i with args[i] (NULL args:
+   all get NULL). The TCBs come from one allocation that is freed when
+   the last of them is reclaimed */
+int worker_create_n(worker_t *threads, int n, pthread_attr_t *attr,
+                    void *(*function)(void *), void **args);
+
+/* wait for n threads; the caller is woken once, when the last one exits.
+   values may be NULL */
+int worker_join_all(worker_t *threads, int n, void **values);
+
+/* wait until every other worker of a fair-share group has exited (they
+   still have to be joined or detached) */
+int worker_group_wait(int group);
+
 /* give CPU pocession to other user level worker threads voluntarily */
 int worker_yield();
 
+/* give the CPU straight to thread if it is runnable and the policy would
+   not rather run someone else; otherwise behaves like worker_yield */
+int worker_yield_to(worker_t thread);
+
 /* terminate a thread */
 void worker_exit(void *value_ptr);
 
 /* wait for thread termination */
 int worker_join(worker_t thread, void **value_ptr);
 
-/* initial the mutex lock */
+/* let a thread's resources be reclaimed when it exits, without a join */
+int worker_detach(worker_t thread);
+
+/* id of the calling worker, -1 before the first worker_create */
+worker_t worker_self(void);
+
+/* initial the mutex lock; mutexattr may make it recursive or
+   error-checking, its other attributes are ignored */
 int worker_mutex_init(worker_mutex_t *mutex, const pthread_mutexattr_t
                                                  *mutexattr);
 
-/* aquire the mutex lock */
+/* aquire the mutex lock; from a kernel thread other than the one running
+   the workers it spins instead of blocking. An error-checking mutex the
+   caller already holds returns -1 with errno EDEADLK */
 int worker_mutex_lock(worker_mutex_t *mutex);
 
-/* release the mutex lock */
+/* aquire the mutex lock if it is free, -1 otherwise */
+int worker_mutex_trylock(worker_mutex_t *mutex);
+
+/* worker_mutex_lock for wrappers: site is the caller the mutex profiler
+   should report instead of the wrapper */
+int worker_mutex_lock_at(worker_mutex_t *mutex, void *site);
+
+/* release the mutex lock, may be called from any kernel thread. A
+   recursive or error-checking mutex the caller does not hold returns -1
+   with errno EPERM */
 int worker_mutex_unlock(worker_mutex_t *mutex);
 
 /* destroy the mutex */
 int worker_mutex_destroy(worker_mutex_t *mutex);
 
+/* initialize the condition variable; attr may select the clock of
+   worker_cond_timedwait, process-shared conditions are not supported */
+int worker_cond_init(worker_cond_t *cond, const pthread_condattr_t *attr);
+
+/* release mutex, block until signalled, take mutex again */
+int worker_cond_wait(worker_cond_t *cond, worker_mutex_t *mutex);
+
+/* worker_cond_wait that gives up at abstime (on the cond's clock):
+   returns -1 with errno ETIMEDOUT */
+int worker_cond_timedwait(worker_cond_t *cond, worker_mutex_t *mutex,
+                          const struct timespec *abstime);
+
+/* wake one waiter / every waiter, may be called from any kernel thread */
+int worker_cond_signal(worker_cond_t *cond);
+int worker_cond_broadcast(worker_cond_t *cond);
+
+/* destroy the condition variable, -1 while workers wait on it */
+int worker_cond_destroy(worker_cond_t *cond);
+
+/* initialize a channel holding up to capacity elements of elemSize bytes */
+int worker_chan_init(worker_chan_t *ch, size_t elemSize, int capacity);
+
+/* send one element, blocking while the channel is full.
+   Returns -1 if the channel is closed */
+int worker_chan_send(worker_chan_t *ch, const void *elem);
+
+/* receive one element, blocking while the channel is empty.
+   Returns -1 once the channel is closed and drained */
+int worker_chan_recv(worker_chan_t *ch, void *elem);
+
+/* non-blocking variants: 0 on success, 1 if the call would block,
+   -1 if the channel is closed */
+int worker_chan_try_send(worker_chan_t *ch, const void *elem);
+int worker_chan_try_recv(worker_chan_t *ch, void *elem);
+
+/* close the channel, waking every blocked sender and receiver */
+int worker_chan_close(worker_chan_t *ch);
+
+/* destroy the channel */
+int worker_chan_destroy(worker_chan_t *ch);
+
+/* typed wrappers: WORKER_CHAN_TYPE(intchan, int) declares
+   intchan_init(ch, capacity), intchan_send(ch, v), intchan_recv(ch, &v), ... */
+#define WORKER_CHAN_TYPE(name, type)                                                        \
+    static inline int name##_init(worker_chan_t *ch, int capacity)                          \
+    { return worker_chan_init(ch, sizeof(type), capacity); }                                \
+    static inline int name##_send(worker_chan_t *ch, type v)                                \
+    { return worker_chan_send(ch, &v); }                                                    \
+    static inline int name##_recv(worker_chan_t *ch, type *v)                               \
+    { return worker_chan_recv(ch, v); }                                                     \
+    static inline int name##_try_send(worker_chan_t *ch, type v)                            \
+    { return worker_chan_try_send(ch, &v); }                                                \
+    static inline int name##_try_recv(worker_chan_t *ch, type *v)                           \
+    { return worker_chan_try_recv(ch, v); }
+
+/* block the calling worker until worker_wake() is called for it */
+int worker_park(void);
+
+/* make a parked worker runnable again, safe to call from any kernel thread
+   (e.g. an I/O completion thread) */
+int worker_wake(worker_t thread);
+
+/* start sampling the running worker's stack hz times per CPU second */
+int worker_prof_start(int hz);
+
+/* stop sampling and write folded stacks ("worker-N;outer;...;inner count",
+   one line per distinct stack) to path, for flamegraph.pl */
+int worker_prof_stop(const char *path);
+
+/* record per-mutex contention statistics from now on (also enabled by
+   setting WORKER_LOCK_PROF=1, which writes the report at exit to stderr
+   or WORKER_LOCK_PROF_OUT) */
+int worker_mutex_prof_start(void);
+
+/* write the profiled mutexes ranked by the time workers spent waiting
+   for them to path (stderr when NULL) */
+int worker_mutex_prof_report(const char *path);
+
+/* publish live counters in shared memory for worker-stat
+   (also enabled by setting WORKER_METRICS=1) */
+int worker_metrics_open(void);
+
+/* remove the shared memory metrics segment */
+void worker_metrics_close(void);
+
+/* Function to print scheduler statistics (idle time, ...) */
+void print_sched_stats(void);
+
 /* Function to print global statistics. Do not modify this function.*/
 void print_app_stats(void);
 
@@ -0,0 +1,49 @@
+// File:	worker-metrics.h
+// List all group member's name: Charles Eshelman, Shane Haughton
+// username of iLab: cae131
+// iLab Server: ice.cs.rutgers.edu
+
+// Layout of the live metrics segment the worker runtime publishes in
+// shared memory (/dev/shm/thread-worker.<pid>) and worker-stat reads.
+
+#ifndef WORKER_METRICS_H
+#define WORKER_METRICS_H
+
+#define METRICS_MAGIC 0x314d4b57u   /* "WKM1" */
+#define METRICS_VERSION 1
+
+/* shm_open name, formatted with the pid of the process */
+#define METRICS_SHM_FMT "/thread-worker.%d"
+
+/* queue levels and per-worker slots in the segment */
+#define METRICS_LEVELS 8
+#define METRICS_MAX_WORKERS 1024
+
+typedef struct workerMetric
+{
+    int tID;            /* -1 for an unused slot */
+    int state;          /* status from thread-worker.h */
+    long cpuUsec;       /* CPU time the worker has used */
+} workerMetric;
+
+/* Readers copy the segment and retry while seq is odd or changed during
+   the copy (seqlock); the runtime never waits for readers. */
+typedef struct workerMetrics
+{
+    unsigned int magic;
+    unsigned int version;
+    volatile unsigned long seq;
+    int pid;
+    int levels;                         /* queue levels in use */
+    long runnable[METRICS_LEVELS];      /* READY workers per queue level */
+    long blocked[METRICS_LEVELS];       /* BLOCKED workers per queue level */
+    long contextSwitches;
+    long preemptions;
+    long mutexAcquired;
+    long mutexContended;
+    long sliceUsec;
+    int numWorkers;                     /* highest used slot + 1 */
+    workerMetric workers[METRICS_MAX_WORKERS];
+} workerMetrics;
+
+#endif
@@ -0,0 +1,134 @@
+// File:	worker-stat.c
+// List all group member's name: Charles Eshelman, Shane Haughton
+// username of iLab: cae131
+// iLab Server: ice.cs.rutgers.edu
+
+// Reads the live metrics a worker process publishes in shared memory
+// (run it with WORKER_METRICS=1 or call worker_metrics_open()).
+//
+//   worker-stat <pid> [interval_ms] [count] [-w]
+//
+// Prints one line per interval with switch/preemption rates, runnable and
+// blocked workers per queue level and mutex contention; -w adds the CPU
+// time of every worker.
+
+#include "worker-metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+static const char *stateName[] = {"READY", "RUNNING", "BLOCKED", "FINISHED"};
+
+/* copy a consistent snapshot of the segment (seqlock read side) */
+static void snapshot(const workerMetrics *seg, workerMetrics *copy)
+{
+	for (;;)
+	{
+		unsigned long seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, (const void *)seg, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int pid = 0, intervalMs = 1000, count = -1, perWorker = 0, pos = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-w") == 0)
+			perWorker = 1;
+		else if (pos == 0)
+			pid = atoi(argv[i]), pos++;
+		else if (pos == 1)
+			intervalMs = atoi(argv[i]), pos++;
+		else
+			count = atoi(argv[i]);
+	}
+	if (pid <= 0 || intervalMs <= 0)
+	{
+		fprintf(stderr, "usage: %s <pid> [interval_ms] [count] [-w]\n", argv[0]);
+		return 1;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), METRICS_SHM_FMT, pid);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		perror(name);
+		return 1;
+	}
+	const workerMetrics *seg = mmap(NULL, sizeof(workerMetrics), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	if (seg->magic != METRICS_MAGIC || seg->version != METRICS_VERSION)
+	{
+		fprintf(stderr, "%s: not a worker metrics segment\n", name);
+		return 1;
+	}
+
+	static workerMetrics prev, now;
+	snapshot(seg, &prev);
+
+	printf("%8s %8s %8s %9s %9s  %-24s %-24s\n", "switch/s", "preempt/s", "slice_us",
+		   "mutex/s", "contend%", "runnable/level", "blocked/level");
+
+	struct timespec delay = { intervalMs / 1000, (intervalMs % 1000) * 1000000L };
+	for (int n = 0; count < 0 || n < count; n++)
+	{
+		nanosleep(&delay, NULL);
+		snapshot(seg, &now);
+
+		double secs = intervalMs / 1000.0;
+		long acquired = now.mutexAcquired - prev.mutexAcquired;
+		long contended = now.mutexContended - prev.mutexContended;
+
+		char runnable[128] = "", blocked[128] = "";
+		for (int lvl = 0; lvl < now.levels && lvl < METRICS_LEVELS; lvl++)
+		{
+			char field[24];
+			snprintf(field, sizeof(field), "%s%ld", lvl ? "/" : "", now.runnable[lvl]);
+			strncat(runnable, field, sizeof(runnable) - strlen(runnable) - 1);
+			snprintf(field, sizeof(field), "%s%ld", lvl ? "/" : "", now.blocked[lvl]);
+			strncat(blocked, field, sizeof(blocked) - strlen(blocked) - 1);
+		}
+
+		printf("%8.0f %8.0f %8ld %9.0f %8.1f%%  %-24s %-24s\n",
+			   (now.contextSwitches - prev.contextSwitches) / secs,
+			   (now.preemptions - prev.preemptions) / secs,
+			   now.sliceUsec, acquired / secs,
+			   acquired ? 100.0 * contended / acquired : 0.0,
+			   runnable, blocked);
+
+		if (perWorker)
+		{
+			for (int i = 0; i < now.numWorkers && i < METRICS_MAX_WORKERS; i++)
+			{
+				const workerMetric *w = &now.workers[i];
+				if (w->tID < 0)
+					continue;
+				long delta = w->cpuUsec - (prev.workers[i].tID == w->tID ? prev.workers[i].cpuUsec : 0);
+				printf("    worker %-6d %-8s cpu %10ld us  (%5.1f%%)\n", w->tID,
+					   w->state >= 0 && w->state <= 3 ? stateName[w->state] : "?",
+					   w->cpuUsec, 100.0 * delta / (intervalMs * 1000.0));
+			}
+		}
+		fflush(stdout);
+		prev = now;
+	}
+
+	return 0;
+}
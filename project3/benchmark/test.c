@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
 #include "../my_vm.h"
 
 #define SIZE 5
@@ -65,6 +66,41 @@ int main(void) {
         printf("\n");
     }
 
+    printf("Copying pieces (one across a page boundary) with put_data_vec/get_data_vec\n");
+    char *v = n_malloc(2 * PGSIZE);
+    char out[3][64], in[3][64];
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 64; j++)
+            out[i][j] = (char)(i * 64 + j);
+    memset(in, 0, sizeof(in));
+    struct vm_iovec put[3] = {
+        {v, out[0], 16},
+        {v + PGSIZE - 20, out[1], 40},
+        {v + PGSIZE + 100, out[2], 64},
+    };
+    struct vm_iovec get[3] = {
+        {v, in[0], 16},
+        {v + PGSIZE - 20, in[1], 40},
+        {v + PGSIZE + 100, in[2], 64},
+    };
+    if (put_data_vec(put, 3) == 0 && get_data_vec(get, 3) == 0 &&
+        memcmp(in[0], out[0], 16) == 0 && memcmp(in[1], out[1], 40) == 0 &&
+        memcmp(in[2], out[2], 64) == 0)
+        printf("vectored copy works\n");
+    else
+        printf("vectored copy does not work\n");
+
+    printf("Copying every %d-th byte with put_data_strided/get_data_strided\n", PGSIZE / 2 + 4);
+    int strided[3] = {7, 8, 9}, back[3] = {0, 0, 0};
+    put_data_strided(v + 10, PGSIZE / 2 + 4, strided, sizeof(int), 3);
+    get_data_strided(v + 10, PGSIZE / 2 + 4, back, sizeof(int), 3);
+    get_data(v + 10 + PGSIZE + 8, &y, sizeof(int));
+    if (memcmp(back, strided, sizeof(strided)) == 0 && y == 9)
+        printf("strided copy works\n");
+    else
+        printf("strided copy does not work\n");
+    n_free(v, 2 * PGSIZE);
+
     printf("Freeing the allocations!\n");
     n_free(a, ARRAY_SIZE);
     n_free(b, ARRAY_SIZE);
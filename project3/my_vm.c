@@ -9,21 +9,82 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
 
 #define VA_BASE 0x40000000u   // base of our simulated virtual region (non-zero)
 
+// virtual pages n_malloc can hand out: MAX_MEMSIZE, or less if VA_BASE leaves less
+#define VA_LIMIT   (VA_MASK - VA_BASE + 1)
+#define VIRT_PAGES ((MAX_MEMSIZE < VA_LIMIT ? MAX_MEMSIZE : VA_LIMIT) / PGSIZE)
+
 // -----------------------------------------------------------------------------
 // Global Declarations
 // -----------------------------------------------------------------------------
-struct tlb tlbGlobal[TLB_ENTRIES];
 struct tlb tlb_store;
 
+// a thread's private TLB
+struct tlb_cpu {
+    struct tlb_set set[TLB_SETS];
+    struct tlb_set large[TLB_LARGE_SETS];   // vpn/pfn of whole large pages
+    unsigned long seen;             // shootdowns applied so far
+    unsigned long long lookups;
+    unsigned long long misses;
+    unsigned long long large_hits;
+    bool registered;                // stats are folded in at thread exit
+    int active;                     // inside put_data/get_data
+    struct tlb_cpu *next;           // registered threads (under tlb_lock)
+};
+static __thread struct tlb_cpu tlbLocal;
+static struct tlb_cpu *tlbThreads = NULL;
+
+// log of unmapped VPN ranges; entry n lives in slot n % TLB_SHOOTDOWN_LOG
+struct shootdown {
+    vaddr_t vpn;
+    uint32_t npages;
+};
+static struct shootdown shootLog[TLB_SHOOTDOWN_LOG];
+static unsigned long shootSeq = 0;  // shootdowns issued
+
+// totals of the threads that exited, plus shootdown stats
 static unsigned long long tlb_lookups = 0;
 static unsigned long long tlb_misses  = 0;
+static unsigned long long tlb_large_hits = 0;
+static unsigned long long tlb_flushes = 0;
+static unsigned long long tlb_invalidations = 0;
+static unsigned long long page_faults = 0;
+static unsigned long long slab_pages = 0;     // under slab_lock
+static unsigned long long slab_objects = 0;
+
+// swap: frame -> VA of the small data page in it (0 = not evictable)
+static vaddr_t  *frame_owner = NULL;
+static uint8_t  *swap_bitmap = NULL;   // 1 bit per used swap slot
+static int       swap_fd     = -1;
+static uint32_t  swap_hint   = 0;      // next slot to try
+static uint32_t  clock_hand  = 0;
+static unsigned long long major_faults = 0;
+static unsigned long long evictions    = 0;
+static unsigned long long swap_in_bytes  = 0;
+static unsigned long long swap_out_bytes = 0;
+static pthread_key_t tlb_key;
+static pthread_once_t tlb_key_once = PTHREAD_ONCE_INIT;
 
 void    *phys_mem     = NULL;  // simulated physical memory buffer
-uint8_t *phys_bitmap  = NULL;  // 1 bit per physical page
-uint8_t *virt_bitmap  = NULL;  // 1 bit per virtual page
+
+// Buddy allocator over the frames: free blocks of 2^order frames, aligned
+// to their size, on one list per order. The largest order is a large page.
+#define BUDDY_ORDERS (PT_BITS + 1)
+#define FRAME_BATCH  64       // frames n_malloc allocates per vm_lock hold
+struct frame_link {
+    int32_t next, prev;   // free list of the block starting at this frame
+    int8_t  order;        // order of that free block, -1 if none starts here
+};
+static struct frame_link *frame_links = NULL;
+static int32_t  free_list[BUDDY_ORDERS];
+static uint32_t free_frames = 0;
+static void buddy_init(uint32_t num_frames);
+uint64_t *virt_bitmap = NULL;  // 1 bit per virtual page, in 64-bit words
+uint8_t *large_bitmap = NULL;  // 1 bit per large-page chunk of VA to fault in whole
 pde_t   *pgdir        = NULL;  // page directory (root page table)
 
 static bool vm_initialized = false;
@@ -34,9 +95,33 @@ static pthread_mutex_t tlb_lock = PTHREAD_MUTEX_INITIALIZER;
 #define BIT_SET(bitmap, i)   ( (bitmap)[(i) / 8] |=  (1u << ((i) % 8)) )
 #define BIT_CLEAR(bitmap, i) ( (bitmap)[(i) / 8] &= ~(1u << ((i) % 8)) )
 #define BIT_TEST(bitmap, i)  ( (bitmap)[(i) / 8] &   (1u << ((i) % 8)) )
+#define VPAGE_USED(i)        ( virt_bitmap[(i) / 64] & (1ull << ((i) % 64)) )
+
+// Free-run summary of virt_bitmap: a segment tree with one leaf per bitmap
+// word (node 1 is the root, leaves start at vmap_leaves). Each node keeps
+// the free pages at the start and end of its range and its longest run.
+struct vmap_node {
+    uint32_t pre;
+    uint32_t suf;
+    uint32_t max;
+};
+static struct vmap_node *vmap_tree = NULL;
+static size_t vmap_leaves = 1;    // a power of two
+static void vmap_init(void);
 
 // present bit
 #define PTE_PRESENT 0x1u
+// set by translate when it loads the PTE; cleared by the CLOCK hand
+#define PTE_ACCESSED 0x20u
+// set in a next-to-last level entry that maps a large page directly
+#define PTE_LARGE   0x80u
+// not present, and the page is in the swap slot held in the PFN field
+#define PTE_SWAPPED 0x200u
+
+#define LARGE_LEVEL (PT_LEVELS - 2)
+
+// host address of a simulated physical frame
+#define FRAME_PTR(frame) ((void *)((uint8_t *)phys_mem + ((uintptr_t)(frame) << PFN_SHIFT)))
 
 // -----------------------------------------------------------------------------
 // Helper: Initialize VM
@@ -59,24 +144,37 @@ static void ensure_vm_init(void)
 
         
         uint32_t num_phys_pages = MEMSIZE / PGSIZE;
-        phys_bitmap = calloc((num_phys_pages + 7) / 8, 1);
-        if (!phys_bitmap)
+        frame_links = calloc(num_phys_pages, sizeof(struct frame_link));
+        if (!frame_links)
         {
-            fprintf(stderr, "OOM phys_bitmap\n");
+            fprintf(stderr, "OOM frame_links\n");
             exit(1);
         }
+        buddy_init(num_phys_pages);
 
         
-        uint32_t num_virt_pages = (uint32_t)(MAX_MEMSIZE / PGSIZE);
-        virt_bitmap = calloc((num_virt_pages + 7) / 8, 1);
-        if (!virt_bitmap)
+        uint64_t num_virt_pages = VIRT_PAGES;
+        while (vmap_leaves * 64 < num_virt_pages)
+            vmap_leaves *= 2;
+        virt_bitmap = calloc(vmap_leaves, sizeof(uint64_t));
+        vmap_tree = calloc(2 * vmap_leaves, sizeof(struct vmap_node));
+        large_bitmap = calloc((num_virt_pages / PT_ENTRIES + 7) / 8 + 1, 1);
+        if (!virt_bitmap || !vmap_tree || !large_bitmap)
         {
             fprintf(stderr, "OOM virt_bitmap\n");
             exit(1);
         }
+        vmap_init();
 
        
-        pgdir = calloc(1024, sizeof(pde_t));
+        frame_owner = calloc(num_phys_pages, sizeof(vaddr_t));
+        if (!frame_owner)
+        {
+            fprintf(stderr, "OOM frame_owner\n");
+            exit(1);
+        }
+
+        pgdir = calloc(PT_ENTRIES, sizeof(pde_t));
         if (!pgdir)
         {
             fprintf(stderr, "OOM pgdir\n");
@@ -84,13 +182,6 @@ static void ensure_vm_init(void)
         }
 
      
-        for (int i = 0; i < TLB_ENTRIES; i++)
-        {
-            tlbGlobal[i].vpn       = 0;
-            tlbGlobal[i].pfn       = 0;
-            tlbGlobal[i].valid     = false;
-            tlbGlobal[i].last_used = 0;
-        }
         tlb_lookups = 0;
         tlb_misses  = 0;
 
@@ -108,106 +199,471 @@ void set_physical_mem(void)
 // -----------------------------------------------------------------------------
 // TLB
 // -----------------------------------------------------------------------------
-int TLB_add(void *va, void *pa)
+// VPN -> set index (Fibonacci hash, so strided VPNs spread over the sets)
+static inline struct tlb_set *tlb_set_of(struct tlb_set *sets, int nsets, vaddr_t vpn)
 {
-    if (!pa)
-        return -1;
+    uint64_t h = vpn * 0x9E3779B97F4A7C15ull;
+    return &sets[nsets > 1 ? h >> (64 - __builtin_ctz(nsets)) : 0];
+}
 
-    vaddr32_t v   = VA2U(va);
-    vaddr32_t vpn = v >> PFN_SHIFT;
-    vaddr32_t pfn = ((uintptr_t)pa - (uintptr_t)phys_mem) >> PFN_SHIFT;
+#define SMALL_SET(vpn)  tlb_set_of(tlbLocal.set, TLB_SETS, vpn)
+#define LARGE_SET(lvpn) tlb_set_of(tlbLocal.large, TLB_LARGE_SETS, lvpn)
 
-    pthread_mutex_lock(&tlb_lock);
+// point the PLRU bits on the path to way w away from it
+static inline void plru_touch(struct tlb_set *set, int w)
+{
+    int node = 1;
+    for (int level = __builtin_ctz(TLB_WAYS) - 1; level >= 0; level--)
+    {
+        int bit = (w >> level) & 1;
+        if (bit)
+            set->plru &= ~(1u << node);
+        else
+            set->plru |= 1u << node;
+        node = 2 * node + bit;
+    }
+}
+
+// follow the PLRU bits down to the least recently used way
+static inline int plru_victim(struct tlb_set *set)
+{
+    int node = 1;
+    while (node < TLB_WAYS)
+        node = 2 * node + ((set->plru >> node) & 1);
+    return node - TLB_WAYS;
+}
+
+// way holding vpn, or -1
+static inline int tlb_find(struct tlb_set *set, vaddr_t vpn)
+{
+    for (int w = 0; w < TLB_WAYS; w++)
+    {
+        if (set->way[w].valid && set->way[w].vpn == vpn)
+            return w;
+    }
+    return -1;
+}
+
+static void tlb_insert(struct tlb_set *set, vaddr_t vpn, uint32_t pfn)
+{
+    // reuse the entry if it is already there, else a free way
+    int idx = tlb_find(set, vpn);
+    for (int w = 0; w < TLB_WAYS && idx < 0; w++)
+    {
+        if (!set->way[w].valid)
+            idx = w;
+    }
+    if (idx < 0)
+        idx = plru_victim(set);
 
-    int empty = -1;
-    for (int i = 0; i < TLB_ENTRIES; i++)
+    set->way[idx].vpn   = vpn;
+    set->way[idx].pfn   = pfn;
+    set->way[idx].valid = true;
+    plru_touch(set, idx);
+}
+
+// drop the small and large entries covering [vpn, vpn + npages)
+static void tlb_invalidate(vaddr_t vpn, uint32_t npages)
+{
+    if (npages >= TLB_ENTRIES)
+        memset(tlbLocal.set, 0, sizeof(tlbLocal.set));
+    else
     {
-        if (!tlbGlobal[i].valid)
+        for (uint32_t i = 0; i < npages; i++)
         {
-            empty = i;
-            break;
+            struct tlb_set *set = SMALL_SET(vpn + i);
+            int w = tlb_find(set, vpn + i);
+            if (w >= 0)
+                set->way[w].valid = false;
         }
     }
 
-    int idx;
-    if (empty >= 0)
+    vaddr_t first = vpn >> PT_BITS, last = (vpn + npages - 1) >> PT_BITS;
+    if (last - first >= TLB_LARGE_ENTRIES)
+        memset(tlbLocal.large, 0, sizeof(tlbLocal.large));
+    else
     {
-        idx = empty;
+        for (vaddr_t l = first; l <= last; l++)
+        {
+            struct tlb_set *set = LARGE_SET(l);
+            int w = tlb_find(set, l);
+            if (w >= 0)
+                set->way[w].valid = false;
+        }
     }
-    else
+}
+
+// fold this thread's counters into the totals
+static void tlb_fold_stats(void *unused)
+{
+    (void)unused;
+    __atomic_fetch_add(&tlb_lookups, tlbLocal.lookups, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tlb_misses, tlbLocal.misses, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tlb_large_hits, tlbLocal.large_hits, __ATOMIC_RELAXED);
+    tlbLocal.lookups = 0;
+    tlbLocal.misses  = 0;
+    tlbLocal.large_hits = 0;
+}
+
+// thread exit: keep the counters and leave the thread list
+static void tlb_thread_exit(void *unused)
+{
+    tlb_fold_stats(unused);
+
+    pthread_mutex_lock(&tlb_lock);
+    for (struct tlb_cpu **t = &tlbThreads; *t; t = &(*t)->next)
     {
-        
-        idx = 0;
-        uint64_t min = tlbGlobal[0].last_used;
-        for (int i = 1; i < TLB_ENTRIES; i++)
+        if (*t == &tlbLocal)
         {
-            if (tlbGlobal[i].last_used < min)
-            {
-                min = tlbGlobal[i].last_used;
-                idx = i;
-            }
+            *t = tlbLocal.next;
+            break;
         }
     }
+    pthread_mutex_unlock(&tlb_lock);
+}
+
+static void tlb_make_key(void)
+{
+    pthread_key_create(&tlb_key, tlb_thread_exit);
+}
+
+// apply the shootdowns issued since this thread last looked
+static void tlb_sync(void)
+{
+    unsigned long seq = __atomic_load_n(&shootSeq, __ATOMIC_ACQUIRE);
+    if (seq == tlbLocal.seen)
+        return;
+
+    bool flush = seq - tlbLocal.seen >= TLB_SHOOTDOWN_LOG;
+    for (unsigned long n = tlbLocal.seen; n < seq && !flush; n++)
+    {
+        struct shootdown *e = &shootLog[n % TLB_SHOOTDOWN_LOG];
+        vaddr_t vpn     = __atomic_load_n(&e->vpn, __ATOMIC_RELAXED);
+        uint32_t npages = __atomic_load_n(&e->npages, __ATOMIC_RELAXED);
+        tlb_invalidate(vpn, npages);
+        __atomic_fetch_add(&tlb_invalidations, 1, __ATOMIC_RELAXED);
+    }
 
-    tlbGlobal[idx].vpn       = vpn;
-    tlbGlobal[idx].pfn       = pfn;
-    tlbGlobal[idx].valid     = true;
-    tlbGlobal[idx].last_used = ++tlb_lookups;
+    // a writer may have reused the slots we just read
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shootSeq, __ATOMIC_RELAXED) - tlbLocal.seen >= TLB_SHOOTDOWN_LOG)
+        flush = true;
 
+    if (flush)
+    {
+        memset(tlbLocal.set, 0, sizeof(tlbLocal.set));
+        memset(tlbLocal.large, 0, sizeof(tlbLocal.large));
+        __atomic_fetch_add(&tlb_flushes, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&tlbLocal.seen, seq, __ATOMIC_RELEASE);
+}
+
+// Log that [vpn, vpn + npages) is unmapped. Call it after the PTEs are
+// cleared and before the frames or VAs are reused.
+// Return: the shootdown's sequence number, for tlb_shootdown_wait.
+static unsigned long tlb_shootdown(vaddr_t vpn, uint32_t npages)
+{
+    pthread_mutex_lock(&tlb_lock);
+    struct shootdown *e = &shootLog[shootSeq % TLB_SHOOTDOWN_LOG];
+    __atomic_store_n(&e->vpn, vpn, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->npages, npages, __ATOMIC_RELAXED);
+    unsigned long seq = shootSeq + 1;
+    __atomic_store_n(&shootSeq, seq, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&tlb_lock);
+    return seq;
+}
+
+// put_data/get_data mark the thread active while they use a translation
+static inline void access_begin(void)
+{
+    __atomic_store_n(&tlbLocal.active, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void access_end(void)
+{
+    __atomic_store_n(&tlbLocal.active, 0, __ATOMIC_RELEASE);
+}
+
+// Wait until no other thread can still be copying through a translation
+// that shootdown seq removed: every thread is either idle or has applied it.
+// Eviction needs this before it reuses the frame; n_free does not, since
+// touching freed memory is the caller's bug.
+static void tlb_shootdown_wait(unsigned long seq)
+{
+    pthread_mutex_lock(&tlb_lock);
+    for (struct tlb_cpu *t = tlbThreads; t; t = t->next)
+    {
+        if (t == &tlbLocal)
+            continue;
+        while (__atomic_load_n(&t->active, __ATOMIC_SEQ_CST) &&
+               __atomic_load_n(&t->seen, __ATOMIC_ACQUIRE) < seq)
+            sched_yield();
+    }
     pthread_mutex_unlock(&tlb_lock);
+}
+
+int TLB_add(void *va, void *pa)
+{
+    if (!pa)
+        return -1;
+
+    vaddr_t v   = VA2V(va);
+    vaddr_t vpn = v >> PFN_SHIFT;
+    uint32_t pfn = ((uintptr_t)pa - (uintptr_t)phys_mem) >> PFN_SHIFT;
+
+    tlb_insert(SMALL_SET(vpn), vpn, pfn);
     return 0;
 }
 
+// cache the large page at va, whose first frame is pfn
+static void tlb_add_large(vaddr_t va, uint32_t pfn)
+{
+    vaddr_t lvpn = va >> (PFN_SHIFT + PT_BITS);
+    tlb_insert(LARGE_SET(lvpn), lvpn, pfn);
+}
+
 pte_t *TLB_check(void *va)
 {
     
-    vaddr32_t v   = VA2U(va);
-    vaddr32_t vpn = v >> PFN_SHIFT;
+    vaddr_t v   = VA2V(va);
+    vaddr_t vpn = v >> PFN_SHIFT;
 
-    pthread_mutex_lock(&tlb_lock);
-    for (int i = 0; i < TLB_ENTRIES; i++)
+    if (!tlbLocal.registered)
     {
-        if (tlbGlobal[i].valid && tlbGlobal[i].vpn == vpn)
-        {
-            tlbGlobal[i].last_used = ++tlb_lookups;
-            void *page_base = (uint8_t *)phys_mem + ((uintptr_t)tlbGlobal[i].pfn << PFN_SHIFT);
-            pthread_mutex_unlock(&tlb_lock);
-            
-            return (pte_t *)page_base;
-        }
+        pthread_once(&tlb_key_once, tlb_make_key);
+        pthread_setspecific(tlb_key, &tlbLocal);
+        pthread_mutex_lock(&tlb_lock);
+        tlbLocal.seen = __atomic_load_n(&shootSeq, __ATOMIC_ACQUIRE);
+        tlbLocal.next = tlbThreads;
+        tlbThreads = &tlbLocal;
+        pthread_mutex_unlock(&tlb_lock);
+        tlbLocal.registered = true;
     }
-    tlb_misses++;
-    pthread_mutex_unlock(&tlb_lock);
+    tlb_sync();
+
+    tlbLocal.lookups++;
+    struct tlb_set *set = SMALL_SET(vpn);
+    int w = tlb_find(set, vpn);
+    if (w >= 0)
+    {
+        plru_touch(set, w);
+        return (pte_t *)FRAME_PTR(set->way[w].pfn);
+    }
+
+    vaddr_t lvpn = vpn >> PT_BITS;
+    set = LARGE_SET(lvpn);
+    w = tlb_find(set, lvpn);
+    if (w >= 0)
+    {
+        plru_touch(set, w);
+        tlbLocal.large_hits++;
+        return (pte_t *)FRAME_PTR(set->way[w].pfn + (vpn & PXMASK));
+    }
+
+    tlbLocal.misses++;
     return NULL;
 }
 
 void print_TLB_missrate(void)
 {
-    double rate = (tlb_lookups == 0) ? 0.0 : (double)tlb_misses / (double)tlb_lookups;
+    tlb_fold_stats(NULL);
+    unsigned long long lookups = __atomic_load_n(&tlb_lookups, __ATOMIC_RELAXED);
+    unsigned long long misses  = __atomic_load_n(&tlb_misses, __ATOMIC_RELAXED);
+    unsigned long long large   = __atomic_load_n(&tlb_large_hits, __ATOMIC_RELAXED);
+
+    double rate = (lookups == 0) ? 0.0 : (double)misses / (double)lookups;
     fprintf(stderr, "TLB miss rate=%lf\n", rate);
+    fprintf(stderr, "TLB hits small=%llu large=%llu\n", lookups - misses - large, large);
+    fprintf(stderr, "TLB shootdowns=%lu applied=%llu flushes=%llu\n",
+            __atomic_load_n(&shootSeq, __ATOMIC_RELAXED),
+            __atomic_load_n(&tlb_invalidations, __ATOMIC_RELAXED),
+            __atomic_load_n(&tlb_flushes, __ATOMIC_RELAXED));
+    fprintf(stderr, "Page faults=%llu\n", __atomic_load_n(&page_faults, __ATOMIC_RELAXED));
+    fprintf(stderr, "Slab objects=%llu pages=%llu\n", slab_objects, slab_pages);
+    fprintf(stderr, "Swap major faults=%llu evictions=%llu in=%llu bytes out=%llu bytes\n",
+            major_faults, evictions, swap_in_bytes, swap_out_bytes);
 }
 
 // -----------------------------------------------------------------------------
-// Helper: allocate a free physical frame
+// Helper: allocate free physical frames (buddy allocator, caller holds vm_lock)
 // -----------------------------------------------------------------------------
+static void buddy_push(uint32_t frame, int order)
+{
+    struct frame_link *f = &frame_links[frame];
+    f->order = order;
+    f->prev = -1;
+    f->next = free_list[order];
+    if (f->next >= 0)
+        frame_links[f->next].prev = frame;
+    free_list[order] = frame;
+}
+
+static void buddy_unlink(uint32_t frame)
+{
+    struct frame_link *f = &frame_links[frame];
+    if (f->prev >= 0)
+        frame_links[f->prev].next = f->next;
+    else
+        free_list[f->order] = f->next;
+    if (f->next >= 0)
+        frame_links[f->next].prev = f->prev;
+    f->order = -1;
+}
+
+// cut memory into the largest aligned blocks that fit
+static void buddy_init(uint32_t num_frames)
+{
+    for (int order = 0; order < BUDDY_ORDERS; order++)
+        free_list[order] = -1;
+    for (uint32_t frame = 0; frame < num_frames; frame++)
+        frame_links[frame].order = -1;
+
+    uint32_t frame = 0;
+    while (frame < num_frames)
+    {
+        int order = BUDDY_ORDERS - 1;
+        while ((frame & ((1u << order) - 1)) || frame + (1u << order) > num_frames)
+            order--;
+        buddy_push(frame, order);
+        frame += 1u << order;
+    }
+    free_frames = num_frames;
+}
+
+// take a block of 2^order frames, splitting a bigger one if needed
+static int buddy_alloc(int order)
+{
+    int from = order;
+    while (from < BUDDY_ORDERS && free_list[from] < 0)
+        from++;
+    if (from == BUDDY_ORDERS)
+        return -1;
+
+    uint32_t frame = free_list[from];
+    buddy_unlink(frame);
+    while (from > order)
+    {
+        from--;
+        buddy_push(frame + (1u << from), from);
+    }
+    free_frames -= 1u << order;
+    return (int)frame;
+}
+
+// give a block back, merging it with its free buddies
+static void buddy_free(uint32_t frame, int order)
+{
+    uint32_t num_frames = MEMSIZE / PGSIZE;
+    free_frames += 1u << order;
+
+    while (order < BUDDY_ORDERS - 1)
+    {
+        uint32_t buddy = frame ^ (1u << order);
+        if (buddy >= num_frames || frame_links[buddy].order != order)
+            break;
+        buddy_unlink(buddy);
+        frame &= ~(1u << order);
+        order++;
+    }
+    buddy_push(frame, order);
+}
+
+static int evict_frame(void);
+
+// evicts a page to swap if memory is full
 static int alloc_phys_frame(void)
+{
+    int frame = buddy_alloc(0);
+    return frame >= 0 ? frame : evict_frame();
+}
+
+static void free_phys_frame(int frame)
+{
+    buddy_free(frame, 0);
+}
+
+// Fill frames[] with up to count frames in one locked call.
+// Return: how many were allocated (fewer only when memory and swap are full).
+static int alloc_phys_frames(int *frames, int count)
+{
+    int n = 0;
+    while (n < count && (frames[n] = alloc_phys_frame()) >= 0)
+        n++;
+    return n;
+}
+
+// Large pages are never swapped, so with swap on they may fill at most half
+// of memory; the rest stays evictable.
+static uint32_t large_frames = 0;
+
+// allocate count contiguous frames aligned to count (PT_ENTRIES at most)
+static int alloc_phys_run(uint32_t count)
 {
     uint32_t num_phys_pages = MEMSIZE / PGSIZE;
+    if (SWAP_PAGES && large_frames + count > num_phys_pages / 2)
+        return -1;
+
+    int frame = buddy_alloc(__builtin_ctz(count));
+    if (frame >= 0)
+        large_frames += count;
+    return frame;
+}
+
+static void free_phys_run(int base, uint32_t count)
+{
+    buddy_free(base, __builtin_ctz(count));
+    large_frames -= count;
+}
 
-    for (uint32_t i = 0; i < num_phys_pages; i++)
+// -----------------------------------------------------------------------------
+// Helper: walk the page tables
+// -----------------------------------------------------------------------------
+// Returns the slot for va in the table at level stop (PT_LEVELS - 1 for the
+// PTE), or the large-page entry above it if va is on a large page. Missing
+// tables are allocated when create is set (the caller holds vm_lock);
+// otherwise the walk returns NULL.
+static pte_t *pt_walk(pde_t *root, vaddr_t va, bool create, int stop)
+{
+    pde_t *table = root;
+    for (int level = 0; level < stop; level++)
     {
-        if (!BIT_TEST(phys_bitmap, i))
+        pde_t pde = table[PX(level, va)];
+        if (pde & PTE_LARGE)
+            return &table[PX(level, va)];
+        if (!(pde & PTE_PRESENT))
         {
-            BIT_SET(phys_bitmap, i);
-            return (int)i;
+            if (!create)
+                return NULL;
+
+            int frame = alloc_phys_frame();
+            if (frame < 0)
+                return NULL;
+            memset(FRAME_PTR(frame), 0, PGSIZE);
+
+            // publish the cleared table before lock-free walkers can see it
+            pde = ((pde_t)frame << PFN_SHIFT) | PTE_PRESENT;
+            __atomic_store_n(&table[PX(level, va)], pde, __ATOMIC_RELEASE);
         }
+        table = (pde_t *)FRAME_PTR(pde >> PFN_SHIFT);
     }
-    return -1;
+    return &table[PX(stop, va)];
 }
 
 // -----------------------------------------------------------------------------
 // Translate VA -> PA (returns page *base* as pte_t*)
 // -----------------------------------------------------------------------------
+static int page_fault(pde_t *pgdir_root, vaddr_t vaddr);
+static int map_frame(pde_t *pgdir_root, vaddr_t vaddr, uint32_t frame);
+
+// read a PTE slot (0 if there is none) and mark a present page accessed
+static inline pte_t pte_touch(pte_t *slot)
+{
+    pte_t pte = slot ? *slot : 0;
+    if ((pte & PTE_PRESENT) && !(pte & PTE_ACCESSED))
+        __atomic_fetch_or(slot, PTE_ACCESSED, __ATOMIC_RELAXED);
+    return pte;
+}
+
 pte_t *translate(pde_t *pgdir_root, void *va)
 {
     if (!pgdir_root)
@@ -220,21 +676,33 @@ pte_t *translate(pde_t *pgdir_root, void *va)
     if (tlb_page_base)
         return tlb_page_base; 
 
-    vaddr32_t vaddr = VA2U(va);
+    vaddr_t vaddr = VA2V(va);
+    pte_t *slot = pt_walk(pgdir_root, vaddr, false, PT_LEVELS - 1);
+    pte_t pte = pte_touch(slot);
 
-    uint32_t pd_index = PDX(vaddr);
-    uint32_t pt_index = PTX(vaddr);
-
-    pde_t pde = pgdir_root[pd_index];
-    if (!(pde & PTE_PRESENT))
-        return NULL;
-
-    uint32_t pt_frame = pde >> PFN_SHIFT;
-    pte_t *pt = (pte_t *)((uint8_t *)phys_mem + ((uintptr_t)pt_frame << PFN_SHIFT));
+    // fault until the page is present (under memory pressure it can be
+    // evicted again before we walk back to it)
+    while (!(pte & PTE_PRESENT))
+    {
+        // not active while the fault waits for vm_lock, or an evicting
+        // thread holding it would wait for us
+        int active = tlbLocal.active;
+        access_end();
+        int rc = page_fault(pgdir_root, vaddr);
+        if (active)
+            access_begin();
+        if (rc != 0)
+            return NULL;
+        slot = pt_walk(pgdir_root, vaddr, false, PT_LEVELS - 1);
+        pte = pte_touch(slot);
+    }
 
-    pte_t pte = pt[pt_index];
-    if (!(pte & PTE_PRESENT))
-        return NULL;
+    if (pte & PTE_LARGE)
+    {
+        uint32_t base_frame = pte >> PFN_SHIFT;
+        tlb_add_large(vaddr, base_frame);
+        return (pte_t *)FRAME_PTR(base_frame + PX(PT_LEVELS - 1, vaddr));
+    }
 
     uint32_t data_frame = pte >> PFN_SHIFT;
     void *page_base = (uint8_t *)phys_mem + ((uintptr_t)data_frame << PFN_SHIFT);
@@ -249,6 +717,18 @@ pte_t *translate(pde_t *pgdir_root, void *va)
 // -----------------------------------------------------------------------------
 // Map a single page: VA page -> PA page
 // -----------------------------------------------------------------------------
+// caller holds vm_lock
+static int map_frame(pde_t *pgdir_root, vaddr_t vaddr, uint32_t frame)
+{
+    pte_t *slot = pt_walk(pgdir_root, vaddr, true, PT_LEVELS - 1);
+    if (!slot || (*slot & (PTE_PRESENT | PTE_SWAPPED)))
+        return -1;
+
+    *slot = ((pte_t)frame << PFN_SHIFT) | PTE_PRESENT;
+    frame_owner[frame] = vaddr;
+    return 0;
+}
+
 int map_page(pde_t *pgdir_root, void *va, void *pa)
 {
     if (!pgdir_root || !va || !pa)
@@ -256,7 +736,7 @@ int map_page(pde_t *pgdir_root, void *va, void *pa)
 
     ensure_vm_init();
 
-    vaddr32_t vaddr = VA2U(va);
+    vaddr_t vaddr = VA2V(va);
 
     
     uintptr_t p_raw  = (uintptr_t)pa;
@@ -265,316 +745,1060 @@ int map_page(pde_t *pgdir_root, void *va, void *pa)
     if ((vaddr & OFFMASK) || (p_off & OFFMASK))
         return -1; 
 
-    uint32_t pd_index = PDX(vaddr);
-    uint32_t pt_index = PTX(vaddr);
-
     pthread_mutex_lock(&vm_lock);
+    int rc = map_frame(pgdir_root, vaddr, (uint32_t)(p_off / PGSIZE));
+    pthread_mutex_unlock(&vm_lock);
+    return rc;
+}
+
+// map the large page at va (LARGE_PGSIZE aligned) to the frames from pa on
+static int map_large_page(pde_t *pgdir_root, vaddr_t va, void *pa)
+{
+    uintptr_t p_off = (uintptr_t)pa - (uintptr_t)phys_mem;
+    if ((va & (LARGE_PGSIZE - 1)) || (p_off & OFFMASK) || PT_LEVELS < 2)
+        return -1;
 
-    pde_t pde = pgdir_root[pd_index];
-    pte_t *pt = NULL;
+    pthread_mutex_lock(&vm_lock);
 
-    if (!(pde & PTE_PRESENT))
+    pte_t *slot = pt_walk(pgdir_root, va, true, LARGE_LEVEL);
+    if (slot && (*slot & PTE_PRESENT) && !(*slot & PTE_LARGE))
     {
-       
-        int pt_frame = alloc_phys_frame();
-        if (pt_frame < 0)
+        // a page table left over from freed small pages: drop it if empty
+        pte_t *pt = (pte_t *)FRAME_PTR(*slot >> PFN_SHIFT);
+        int k = 0;
+        while (k < (int)PT_ENTRIES && !(pt[k] & PTE_PRESENT))
+            k++;
+        if (k == (int)PT_ENTRIES)
         {
-            pthread_mutex_unlock(&vm_lock);
-            return -1;
+            // unhook it, and let lock-free walkers that may still be
+            // reading it finish before the frame is reused
+            int frame = (int)(*slot >> PFN_SHIFT);
+            __atomic_store_n(slot, 0, __ATOMIC_RELEASE);
+            tlb_shootdown_wait(tlb_shootdown(va >> PFN_SHIFT, PT_ENTRIES));
+            free_phys_frame(frame);
         }
-
-        pt = (pte_t *)((uint8_t *)phys_mem + ((uintptr_t)pt_frame << PFN_SHIFT));
-        memset(pt, 0, PGSIZE);
-
-        pgdir_root[pd_index] = ((uintptr_t)pt_frame << PFN_SHIFT) | PTE_PRESENT;
-    }
-    else
-    {
-        uint32_t pt_frame = pgdir_root[pd_index] >> PFN_SHIFT;
-        pt = (pte_t *)((uint8_t *)phys_mem + ((uintptr_t)pt_frame << PFN_SHIFT));
     }
-
-    if (pt[pt_index] & PTE_PRESENT)
+    if (!slot || (*slot & PTE_PRESENT))
     {
         pthread_mutex_unlock(&vm_lock);
-        return -1; 
+        return -1;
     }
-
-    
-    uint32_t frame_index = (uint32_t)(p_off / PGSIZE);
-    pt[pt_index] = ((uintptr_t)frame_index << PFN_SHIFT) | PTE_PRESENT;
+    *slot = ((pte_t)(p_off / PGSIZE) << PFN_SHIFT) | PTE_LARGE | PTE_PRESENT;
 
     pthread_mutex_unlock(&vm_lock);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
-// Get Next Available Virtual Pages
+// Swapping
 // -----------------------------------------------------------------------------
-void *get_next_avail(int num_pages)
+static int swap_open(void)
 {
-    ensure_vm_init();
-    pthread_mutex_lock(&vm_lock);
+    if (swap_fd >= 0)
+        return 0;
 
-    int max_pages = (int)(MAX_MEMSIZE / PGSIZE);
-    int start = -1;
+    char path[] = "/tmp/my_vm.swap.XXXXXX";
+    swap_fd = mkstemp(path);
+    swap_bitmap = calloc(SWAP_PAGES / 8 + 1, 1);
+    if (swap_fd < 0 || !swap_bitmap)
+    {
+        fprintf(stderr, "cannot create swap file\n");
+        return -1;
+    }
+    unlink(path);
+    return 0;
+}
 
-    for (int i = 0; i <= max_pages - num_pages; i++)
+// caller holds vm_lock
+static int alloc_swap_slot(void)
+{
+    for (uint32_t n = 0; n < SWAP_PAGES; n++)
     {
-        bool free = true;
-        for (int j = 0; j < num_pages; j++)
+        uint32_t slot = (swap_hint + n) % SWAP_PAGES;
+        if (!BIT_TEST(swap_bitmap, slot))
         {
-            if (BIT_TEST(virt_bitmap, i + j))
-            {
-                free = false;
-                break;
-            }
+            BIT_SET(swap_bitmap, slot);
+            swap_hint = slot + 1;
+            return (int)slot;
         }
-        if (free)
+    }
+    return -1;
+}
+
+// Write a small data page out to swap and return its frame (caller holds
+// vm_lock). The CLOCK hand gives accessed pages a second chance; page
+// tables and large pages are never evicted.
+static int evict_frame(void)
+{
+    uint32_t num_phys_pages = MEMSIZE / PGSIZE;
+    if (SWAP_PAGES == 0 || swap_open() != 0)
+        return -1;
+
+    for (uint32_t n = 0; n < 2 * num_phys_pages; n++)
+    {
+        uint32_t frame = clock_hand;
+        clock_hand = (clock_hand + 1) % num_phys_pages;
+
+        vaddr_t owner = frame_owner[frame];
+        if (!owner)
+            continue;
+        pte_t *pte = pt_walk(pgdir, owner, false, PT_LEVELS - 1);
+        if (!pte || (*pte & PTE_LARGE) || !(*pte & PTE_PRESENT))
+            continue;
+        if (__atomic_fetch_and(pte, ~PTE_ACCESSED, __ATOMIC_RELAXED) & PTE_ACCESSED)
+            continue;
+
+        int slot = alloc_swap_slot();
+        if (slot < 0)
+            return -1;
+
+        // unmap before copying, so later accesses fault and wait on vm_lock,
+        // and let copies through the old translation finish
+        *pte = ((pte_t)slot << PFN_SHIFT) | PTE_SWAPPED;
+        tlb_shootdown_wait(tlb_shootdown(owner >> PFN_SHIFT, 1));
+
+        if (pwrite(swap_fd, FRAME_PTR(frame), PGSIZE, (off_t)slot * PGSIZE) != PGSIZE)
         {
-            start = i;
-            break;
+            fprintf(stderr, "swap write failed\n");
+            exit(1);
         }
+        frame_owner[frame] = 0;
+        evictions++;
+        swap_out_bytes += PGSIZE;
+        return (int)frame;
     }
+    return -1;
+}
 
-    if (start < 0)
+// Page vaddr back in if it is swapped out.
+// Return: 0 if it was (or another thread already did it), -1 otherwise.
+static int swap_in(pde_t *pgdir_root, vaddr_t vaddr)
+{
+    pthread_mutex_lock(&vm_lock);
+    pte_t *pte = pt_walk(pgdir_root, vaddr, false, PT_LEVELS - 1);
+    if (!pte || !(*pte & (PTE_SWAPPED | PTE_PRESENT)))
     {
         pthread_mutex_unlock(&vm_lock);
-        return NULL;
+        return -1;
+    }
+    if (*pte & PTE_PRESENT)
+    {
+        pthread_mutex_unlock(&vm_lock);
+        return 0;
     }
 
-    for (int j = 0; j < num_pages; j++)
-        BIT_SET(virt_bitmap, start + j);
+    uint32_t slot = *pte >> PFN_SHIFT;
+    int frame = alloc_phys_frame();
+    if (frame < 0)
+    {
+        pthread_mutex_unlock(&vm_lock);
+        return -1;
+    }
+    if (pread(swap_fd, FRAME_PTR(frame), PGSIZE, (off_t)slot * PGSIZE) != PGSIZE)
+    {
+        fprintf(stderr, "swap read failed\n");
+        exit(1);
+    }
+    BIT_CLEAR(swap_bitmap, slot);
 
-    vaddr32_t va32 = VA_BASE + (vaddr32_t)start * PGSIZE;
+    vaddr_t page = vaddr & ~(vaddr_t)OFFMASK;
+    *pte = ((pte_t)frame << PFN_SHIFT) | PTE_ACCESSED | PTE_PRESENT;
+    frame_owner[frame] = page;
+    major_faults++;
+    swap_in_bytes += PGSIZE;
 
     pthread_mutex_unlock(&vm_lock);
-    return U2VA(va32);
+    return 0;
 }
 
 // -----------------------------------------------------------------------------
-// Allocation / Free
+// Demand Paging
 // -----------------------------------------------------------------------------
-void *n_malloc(unsigned int num_bytes)
+// Back the reserved but unmapped page at vaddr with a zeroed frame, or its
+// whole chunk with a large page if n_malloc marked the chunk for one.
+// Return: 0 if the page may now be mapped (the caller walks again), -1 if
+// vaddr was never allocated or memory is exhausted.
+static int page_fault(pde_t *pgdir_root, vaddr_t vaddr)
 {
-    ensure_vm_init();
+    if (vaddr < VA_BASE || (vaddr - VA_BASE) / PGSIZE >= VIRT_PAGES)
+        return -1;
 
-    if (num_bytes == 0)
-        return NULL;
+    if (swap_in(pgdir_root, vaddr) == 0)
+        return 0;
+    if (!DEMAND_PAGING)
+        return -1;
 
-    int num_pages = (num_bytes + PGSIZE - 1) / PGSIZE;
+    uint64_t vpage = (vaddr - VA_BASE) / PGSIZE;
+    uint64_t chunk = vpage / PT_ENTRIES;
+    int frame = -1, npages = 1;
 
-    void *va_base = get_next_avail(num_pages);
-    if (!va_base)
-        return NULL;
+    pthread_mutex_lock(&vm_lock);
+    if (!VPAGE_USED(vpage))
+    {
+        pthread_mutex_unlock(&vm_lock);
+        return -1;
+    }
+    if (BIT_TEST(large_bitmap, chunk))
+    {
+        frame = alloc_phys_run(PT_ENTRIES);
+        if (frame >= 0)
+            npages = PT_ENTRIES;
+        else
+            BIT_CLEAR(large_bitmap, chunk);
+    }
+    if (frame < 0)
+        frame = alloc_phys_frame();
+    pthread_mutex_unlock(&vm_lock);
 
-    int *allocated_frames = (int *)malloc(sizeof(int) * num_pages);
-    if (!allocated_frames)
-        return NULL;
-    for (int i = 0; i < num_pages; i++)
-        allocated_frames[i] = -1;
+    if (frame < 0)
+        return -1;
+    memset(FRAME_PTR(frame), 0, (size_t)npages * PGSIZE);
 
-    for (int i = 0; i < num_pages; i++)
+    int rc = npages > 1
+        ? map_large_page(pgdir_root, vaddr & ~(LARGE_PGSIZE - 1), FRAME_PTR(frame))
+        : map_page(pgdir_root, V2VA(vaddr & ~(vaddr_t)OFFMASK), FRAME_PTR(frame));
+    if (rc != 0)
     {
+        // another thread mapped it first, or the large page did not fit
+        // (the next fault uses small pages)
         pthread_mutex_lock(&vm_lock);
-        int frame = alloc_phys_frame();
+        if (npages > 1)
+        {
+            free_phys_run(frame, npages);
+            BIT_CLEAR(large_bitmap, chunk);
+        }
+        else
+            free_phys_frame(frame);
         pthread_mutex_unlock(&vm_lock);
+        return 0;
+    }
+
+    __atomic_fetch_add(&page_faults, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Get Next Available Virtual Pages
+// -----------------------------------------------------------------------------
+// summary of one bitmap word (1 bits are used pages)
+static void vmap_leaf(size_t leaf)
+{
+    uint64_t used = virt_bitmap[leaf];
+    struct vmap_node *n = &vmap_tree[vmap_leaves + leaf];
+
+    n->pre = used ? __builtin_ctzll(used) : 64;
+    n->suf = used ? __builtin_clzll(used) : 64;
+
+    // longest run of free bits: each step shortens every run by one
+    uint64_t free = ~used;
+    uint32_t max = 0;
+    for (; free; max++)
+        free &= free >> 1;
+    n->max = max;
+}
+
+// combine the children of node, each covering half of len pages
+static void vmap_pull(size_t node, uint64_t len)
+{
+    struct vmap_node *l = &vmap_tree[2 * node], *r = &vmap_tree[2 * node + 1];
+    uint32_t half = len / 2;
+
+    vmap_tree[node].pre = l->pre == half ? half + r->pre : l->pre;
+    vmap_tree[node].suf = r->suf == half ? half + l->suf : r->suf;
+    uint32_t max = l->max > r->max ? l->max : r->max;
+    vmap_tree[node].max = l->suf + r->pre > max ? l->suf + r->pre : max;
+}
+
+// mark pages [first, first + count) used or free and update the summary
+static void vmap_mark(uint64_t first, uint64_t count, bool used)
+{
+    if (count == 0)
+        return;
+
+    uint64_t end = first + count;
+    for (uint64_t w = first / 64; w <= (end - 1) / 64; w++)
+    {
+        uint64_t lo = w * 64 > first ? 0 : first % 64;
+        uint64_t hi = (w + 1) * 64 <= end ? 64 : end % 64;
+        uint64_t mask = (hi == 64 ? ~0ull : (1ull << hi) - 1) & ~((1ull << lo) - 1);
+        if (used)
+            virt_bitmap[w] |= mask;
+        else
+            virt_bitmap[w] &= ~mask;
+        vmap_leaf(w);
+    }
 
-        if (frame < 0)
+    size_t lo = vmap_leaves + first / 64, hi = vmap_leaves + (end - 1) / 64;
+    for (uint64_t len = 128; lo > 1; len *= 2)
+    {
+        lo /= 2;
+        hi /= 2;
+        for (size_t node = lo; node <= hi; node++)
+            vmap_pull(node, len);
+    }
+}
+
+// everything free except the padding past VIRT_PAGES
+static void vmap_init(void)
+{
+    for (size_t leaf = 0; leaf < vmap_leaves; leaf++)
+        vmap_leaf(leaf);
+    uint64_t len = 128;
+    for (size_t level = vmap_leaves / 2; level >= 1; level /= 2, len *= 2)
+        for (size_t node = level; node < 2 * level; node++)
+            vmap_pull(node, len);
+    vmap_mark(VIRT_PAGES, vmap_leaves * 64 - VIRT_PAGES, true);
+}
+
+// Search the word of one leaf. carry is the length of the free run that
+// ends just before lo and starts at *start.
+static long vmap_find_leaf(size_t leaf, uint64_t lo, uint64_t from, uint64_t n,
+                           uint64_t *carry, uint64_t *start)
+{
+    uint64_t used = virt_bitmap[leaf];
+    if (from > lo)
+        used |= (1ull << (from - lo)) - 1;
+
+    uint64_t pre = used ? __builtin_ctzll(used) : 64;
+    if (*carry + pre >= n)
+        return *carry ? (long)*start : (long)lo;
+    if (!used)
+    {
+        if (!*carry)
+            *start = lo;
+        *carry += 64;
+        return -1;
+    }
+
+    // runs inside the word, then the one that continues into the next
+    uint64_t free = ~used;
+    while (free)
+    {
+        unsigned s = __builtin_ctzll(free);
+        uint64_t rest = ~(free >> s);
+        unsigned len = rest ? __builtin_ctzll(rest) : 64 - s;
+        if (s + len == 64)
         {
-            
-            for (int k = 0; k < i; k++)
-            {
-                if (allocated_frames[k] >= 0)
-                {
-                    pthread_mutex_lock(&vm_lock);
-                    BIT_CLEAR(phys_bitmap, allocated_frames[k]);
-                    pthread_mutex_unlock(&vm_lock);
-                }
-            }
-            free(allocated_frames);
-            return NULL;
+            // long enough on its own; carried out of the last leaf it would be lost
+            if (len >= n)
+                return (long)(lo + s);
+            *carry = len;
+            *start = lo + s;
+            return -1;
         }
+        if (len >= n)
+            return (long)(lo + s);
+        free &= ~(((1ull << len) - 1) << s);
+    }
+    *carry = 0;
+    return -1;
+}
 
-        allocated_frames[i] = frame;
-
-        vaddr32_t page_va32 = VA2U(va_base) + (vaddr32_t)i * PGSIZE;
-        void *page_va = U2VA(page_va32);
-        void *page_pa = (uint8_t *)phys_mem + ((uintptr_t)frame << PFN_SHIFT);
+// Leftmost start >= from of n free pages, or -1. Subtrees whose longest
+// run is too short are stepped over whole, so only the path to from and
+// the path to the answer are walked.
+static long vmap_find_node(size_t node, uint64_t lo, uint64_t len, uint64_t from,
+                           uint64_t n, uint64_t *carry, uint64_t *start)
+{
+    if (lo + len <= from)
+        return -1;
 
-        if (map_page(pgdir, page_va, page_pa) != 0)
+    struct vmap_node *s = &vmap_tree[node];
+    if (lo >= from)
+    {
+        if (*carry + s->pre >= n)
+            return *carry ? (long)*start : (long)lo;
+        if (s->max < n)
         {
-         
-            for (int k = 0; k <= i; k++)
+            if (s->pre == len)
             {
-                if (allocated_frames[k] >= 0)
-                {
-                    pthread_mutex_lock(&vm_lock);
-                    BIT_CLEAR(phys_bitmap, allocated_frames[k]);
-                    pthread_mutex_unlock(&vm_lock);
-                }
+                if (!*carry)
+                    *start = lo;
+                *carry += len;
             }
-            free(allocated_frames);
-            return NULL;
+            else
+            {
+                *carry = s->suf;
+                *start = lo + len - s->suf;
+            }
+            return -1;
         }
     }
 
-    free(allocated_frames);
-    return va_base;
+    if (node >= vmap_leaves)
+        return vmap_find_leaf(node - vmap_leaves, lo, from, n, carry, start);
+
+    long found = vmap_find_node(2 * node, lo, len / 2, from, n, carry, start);
+    if (found >= 0)
+        return found;
+    return vmap_find_node(2 * node + 1, lo + len / 2, len / 2, from, n, carry, start);
 }
 
-void n_free(void *va, int size)
+static long vmap_find(uint64_t from, uint64_t n)
 {
-    if (!va || size <= 0)
-        return;
+    uint64_t carry = 0, start = 0;
+    return vmap_find_node(1, 0, vmap_leaves * 64, from, n, &carry, &start);
+}
 
+// first free run of num_pages starting at a multiple of align pages
+static void *get_next_avail_aligned(int num_pages, int align)
+{
     ensure_vm_init();
+    pthread_mutex_lock(&vm_lock);
+
+    // runs that start off alignment: retry from the next aligned page
+    long start = -1;
+    uint64_t from = 0;
+    while (num_pages > 0 && from < VIRT_PAGES)
+    {
+        start = vmap_find(from, num_pages);
+        if (start < 0 || start % align == 0)
+            break;
+        from = (start / align + 1) * (uint64_t)align;
+        start = -1;
+    }
+
+    if (start < 0)
+    {
+        pthread_mutex_unlock(&vm_lock);
+        return NULL;
+    }
+
+    vmap_mark(start, num_pages, true);
+
+    vaddr_t base_vaddr = VA_BASE + (vaddr_t)start * PGSIZE;
+
+    pthread_mutex_unlock(&vm_lock);
+    return V2VA(base_vaddr);
+}
+
+void *get_next_avail(int num_pages)
+{
+    return get_next_avail_aligned(num_pages, 1);
+}
+
+// -----------------------------------------------------------------------------
+// Allocation / Free
+// -----------------------------------------------------------------------------
+// Replace the large page in slot (the chunk holding va) by a page table of
+// small PTEs for the same frames, so part of it can be unmapped. The frames
+// become ordinary, evictable pages (caller holds vm_lock).
+// Return: 0, or -1 if there is no frame for the table.
+static int split_large_page(pte_t *slot, vaddr_t va)
+{
+    int pt = alloc_phys_frame();
+    if (pt < 0)
+        return -1;
+
+    pte_t large = *slot;
+    uint32_t base = large >> PFN_SHIFT;
+    vaddr_t chunk = va & ~(vaddr_t)(LARGE_PGSIZE - 1);
+    pte_t *table = (pte_t *)FRAME_PTR(pt);
+    for (uint32_t k = 0; k < PT_ENTRIES; k++)
+    {
+        table[k] = ((pte_t)(base + k) << PFN_SHIFT) | (large & PTE_ACCESSED) | PTE_PRESENT;
+        frame_owner[base + k] = chunk + (vaddr_t)k * PGSIZE;
+    }
+    large_frames -= PT_ENTRIES;
 
-    int num_pages = (size + PGSIZE - 1) / PGSIZE;
-    vaddr32_t base_va32 = VA2U(va);
+    // same translations as before, so cached large entries stay correct
+    // until the caller's shootdown
+    __atomic_store_n(slot, ((pde_t)pt << PFN_SHIFT) | PTE_PRESENT, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// frames[] mark for a page whose VA stays reserved
+#define KEEP_VA (-2)
+
+// Unmap num_pages pages from base_vaddr and release their frames and VAs.
+// A large page is released whole when the range covers it, and split into
+// small pages when the range covers only part of it.
+static void unmap_pages(vaddr_t base_vaddr, int num_pages)
+{
+    int *frames = (int *)malloc(sizeof(int) * num_pages);
+    if (!frames)
+        return;
 
+    // unmap first, so no thread can load a translation for a reused frame
+    // (under vm_lock, so the CLOCK hand cannot evict pages meanwhile)
+    pthread_mutex_lock(&vm_lock);
     for (int i = 0; i < num_pages; i++)
     {
-        vaddr32_t curr_va32 = base_va32 + (vaddr32_t)i * PGSIZE;
+        vaddr_t curr_vaddr = base_vaddr + (vaddr_t)i * PGSIZE;
+        frames[i] = -1;
 
-        uint32_t pd_index = PDX(curr_va32);
-        uint32_t pt_index = PTX(curr_va32);
+        pte_t *slot = pt_walk(pgdir, curr_vaddr, false, PT_LEVELS - 1);
+        if (!slot)
+            continue;
 
-        pde_t pde = pgdir[pd_index];
-        if (!(pde & PTE_PRESENT))
+        pte_t pte = *slot;
+        if (pte & PTE_SWAPPED)
+        {
+            BIT_CLEAR(swap_bitmap, pte >> PFN_SHIFT);
+            *slot = 0;
+            continue;
+        }
+        if (!(pte & PTE_PRESENT))
             continue;
 
-        uint32_t pt_frame = pde >> PFN_SHIFT;
-        pte_t *pt = (pte_t *)((uint8_t *)phys_mem + ((uintptr_t)pt_frame << PFN_SHIFT));
+        if (pte & PTE_LARGE)
+        {
+            if ((curr_vaddr & (LARGE_PGSIZE - 1)) || num_pages - i < (int)PT_ENTRIES)
+            {
+                // walk this page again through the small PTEs; without a
+                // frame for them, the page stays mapped and its VA in use
+                if (split_large_page(slot, curr_vaddr) == 0)
+                    i--;
+                else
+                    frames[i] = KEEP_VA;
+                continue;
+            }
+            // no one can reuse the run before vm_lock is dropped
+            free_phys_run(pte >> PFN_SHIFT, PT_ENTRIES);
+            for (int k = 1; k < (int)PT_ENTRIES; k++)
+                frames[i + k] = -1;
+            *slot = 0;
+            i += PT_ENTRIES - 1;
+            continue;
+        }
 
-        pte_t pte = pt[pt_index];
-        if (!(pte & PTE_PRESENT))
+        frames[i] = (int)(pte >> PFN_SHIFT);
+        frame_owner[frames[i]] = 0;
+        *slot = 0;
+    }
+
+    tlb_shootdown(base_vaddr >> PFN_SHIFT, (uint32_t)num_pages);
+
+    // release the VA of every page, mapped or (with demand paging) not yet
+    uint64_t vfirst = 0, vend = 0;
+    for (int i = 0; i < num_pages; i++)
+    {
+        if (frames[i] >= 0)
+            free_phys_frame(frames[i]);
+
+        vaddr_t curr_vaddr = base_vaddr + (vaddr_t)i * PGSIZE;
+        if (curr_vaddr < VA_BASE || (curr_vaddr - VA_BASE) / PGSIZE >= VIRT_PAGES)
             continue;
 
-        uint32_t frame = pte >> PFN_SHIFT;
+        // a chunk freed even in part faults in small pages from now on
+        uint64_t vpage = (curr_vaddr - VA_BASE) / PGSIZE;
+        BIT_CLEAR(large_bitmap, vpage / PT_ENTRIES);
+        if (frames[i] == KEEP_VA)
+            continue;
 
-        
-        pthread_mutex_lock(&vm_lock);
-        BIT_CLEAR(phys_bitmap, frame);
-        pthread_mutex_unlock(&vm_lock);
+        if (vend == 0 || vpage != vend)
+        {
+            if (vend)
+                vmap_mark(vfirst, vend - vfirst, false);
+            vfirst = vpage;
+        }
+        vend = vpage + 1;
+    }
+    if (vend)
+        vmap_mark(vfirst, vend - vfirst, false);
+    pthread_mutex_unlock(&vm_lock);
 
-        
-        int virt_index = (int)((curr_va32 - VA_BASE) / PGSIZE);
-        if (virt_index >= 0)
+    free(frames);
+}
+
+// map whole pages for num_bytes
+static void *page_alloc(unsigned int num_bytes)
+{
+    int num_pages = (num_bytes + PGSIZE - 1) / PGSIZE;
+
+    // 4 MB and up: align the VA so whole chunks can go on large pages
+    bool use_large = num_bytes >= LARGE_PGSIZE && PT_LEVELS >= 2;
+
+    void *va_base = get_next_avail_aligned(num_pages, use_large ? (int)PT_ENTRIES : 1);
+    if (!va_base)
+        return NULL;
+
+    if (DEMAND_PAGING)
+    {
+        // frames come on first touch; mark the whole chunks for large pages
+        if (use_large)
         {
+            uint64_t chunk = (VA2V(va_base) - VA_BASE) / LARGE_PGSIZE;
             pthread_mutex_lock(&vm_lock);
-            BIT_CLEAR(virt_bitmap, virt_index);
+            for (int c = 0; c < num_pages / (int)PT_ENTRIES; c++)
+                BIT_SET(large_bitmap, chunk + c);
             pthread_mutex_unlock(&vm_lock);
         }
+        return va_base;
+    }
 
-       
-        pt[pt_index] = 0;
+    int frames[FRAME_BATCH];
+    int i = 0;
+    while (i < num_pages)
+    {
+        vaddr_t page_vaddr = VA2V(va_base) + (vaddr_t)i * PGSIZE;
 
-        
-        pthread_mutex_lock(&tlb_lock);
-        uint32_t vpn = curr_va32 >> PFN_SHIFT;
-        for (int j = 0; j < TLB_ENTRIES; j++)
+        if (use_large && num_pages - i >= (int)PT_ENTRIES)
         {
-            if (tlbGlobal[j].valid && tlbGlobal[j].vpn == vpn)
-                tlbGlobal[j].valid = false;
+            pthread_mutex_lock(&vm_lock);
+            int frame = alloc_phys_run(PT_ENTRIES);
+            pthread_mutex_unlock(&vm_lock);
+
+            if (frame >= 0 && map_large_page(pgdir, page_vaddr, FRAME_PTR(frame)) == 0)
+            {
+                i += PT_ENTRIES;
+                continue;
+            }
+            // fall back to small pages for the rest
+            if (frame >= 0)
+            {
+                pthread_mutex_lock(&vm_lock);
+                free_phys_run(frame, PT_ENTRIES);
+                pthread_mutex_unlock(&vm_lock);
+            }
+            use_large = false;
         }
-        pthread_mutex_unlock(&tlb_lock);
+
+        // small pages: allocate and map a batch under one lock
+        int want = num_pages - i < FRAME_BATCH ? num_pages - i : FRAME_BATCH;
+        pthread_mutex_lock(&vm_lock);
+        int got = alloc_phys_frames(frames, want);
+        int mapped = 0;
+        while (mapped < got && map_frame(pgdir, page_vaddr + (vaddr_t)mapped * PGSIZE, frames[mapped]) == 0)
+            mapped++;
+        for (int k = mapped; k < got; k++)
+            free_phys_frame(frames[k]);
+        pthread_mutex_unlock(&vm_lock);
+
+        i += mapped;
+        if (mapped < want)
+            break;
+    }
+
+    if (i < num_pages)
+    {
+        // out of memory: undo the mappings and give the rest of the VA back
+        unmap_pages(VA2V(va_base), i);
+
+        pthread_mutex_lock(&vm_lock);
+        uint64_t first = (VA2V(va_base) - VA_BASE) / PGSIZE;
+        vmap_mark(first + i, num_pages - i, false);
+        pthread_mutex_unlock(&vm_lock);
+        return NULL;
     }
+
+    return va_base;
 }
 
 // -----------------------------------------------------------------------------
-// Data Movement
+// Slab allocator for small objects
 // -----------------------------------------------------------------------------
-int put_data(void *va, void *val, int size)
+// A slab is one page of objects of a single size class. Its metadata lives
+// outside simulated memory and is found from the page number through a
+// two-level directory, so n_free can tell objects from pages.
+#define SLAB_MIN       16
+#define SLAB_CLASSES   (__builtin_ctz(PGSIZE) - __builtin_ctz(SLAB_MIN))
+#define SLAB_DIR_SPAN  1024      // pages per second-level directory table
+
+struct slab {
+    vaddr_t base;                // VA of the page
+    uint32_t size;               // object size
+    uint32_t nfree;
+    struct slab *next, *prev;    // on its class list while not full
+    uint64_t used[PGSIZE / SLAB_MIN / 64];
+};
+
+struct slab_class {
+    struct slab *list;           // slabs with free objects: ones that were full
+                                 // in front, new ones at the back
+    struct slab *spare;          // an empty slab kept for the next request
+};
+
+static struct slab_class slab_classes[SLAB_CLASSES];
+static struct slab ***slab_dir = NULL;
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// directory entry for vaddr (created if create is set), or NULL
+static struct slab **slab_entry(vaddr_t vaddr, bool create)
 {
-    if (!va || !val || size <= 0)
+    if (vaddr < VA_BASE || (vaddr - VA_BASE) / PGSIZE >= VIRT_PAGES)
+        return NULL;
+    uint64_t vpage = (vaddr - VA_BASE) / PGSIZE;
+
+    if (!slab_dir)
+    {
+        if (!create)
+            return NULL;
+        slab_dir = calloc(VIRT_PAGES / SLAB_DIR_SPAN + 1, sizeof(struct slab **));
+        if (!slab_dir)
+            return NULL;
+    }
+    struct slab **table = slab_dir[vpage / SLAB_DIR_SPAN];
+    if (!table)
+    {
+        if (!create)
+            return NULL;
+        table = calloc(SLAB_DIR_SPAN, sizeof(struct slab *));
+        if (!table)
+            return NULL;
+        slab_dir[vpage / SLAB_DIR_SPAN] = table;
+    }
+    return &table[vpage % SLAB_DIR_SPAN];
+}
+
+static void slab_unlink(struct slab_class *cls, struct slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        cls->list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+// new slabs go to the back, so partly used ones fill up first
+static void slab_append(struct slab_class *cls, struct slab *slab)
+{
+    struct slab **link = &cls->list;
+    struct slab *prev = NULL;
+    while (*link)
+    {
+        prev = *link;
+        link = &prev->next;
+    }
+    slab->prev = prev;
+    slab->next = NULL;
+    *link = slab;
+}
+
+static void slab_push(struct slab_class *cls, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = cls->list;
+    if (cls->list)
+        cls->list->prev = slab;
+    cls->list = slab;
+}
+
+// caller holds slab_lock
+static struct slab *slab_create(uint32_t size)
+{
+    struct slab *slab = calloc(1, sizeof(struct slab));
+    if (!slab)
+        return NULL;
+
+    void *page = page_alloc(PGSIZE);
+    struct slab **entry = page ? slab_entry(VA2V(page), true) : NULL;
+    if (!entry)
+    {
+        if (page)
+            unmap_pages(VA2V(page), 1);
+        free(slab);
+        return NULL;
+    }
+
+    // slots past the end of the page stay used
+    uint32_t count = PGSIZE / size;
+    for (uint32_t k = count; k < PGSIZE / SLAB_MIN; k++)
+        slab->used[k / 64] |= 1ull << (k % 64);
+
+    slab->base = VA2V(page);
+    slab->size = size;
+    slab->nfree = count;
+    *entry = slab;
+    slab_pages++;
+    return slab;
+}
+
+static void *slab_alloc(unsigned int num_bytes)
+{
+    int cls_index = 0;
+    while ((SLAB_MIN << cls_index) < num_bytes)
+        cls_index++;
+    struct slab_class *cls = &slab_classes[cls_index];
+
+    pthread_mutex_lock(&slab_lock);
+    struct slab *slab = cls->list;
+    if (!slab)
+    {
+        slab = slab_create(SLAB_MIN << cls_index);
+        if (!slab)
+        {
+            pthread_mutex_unlock(&slab_lock);
+            return NULL;
+        }
+        slab_append(cls, slab);
+    }
+    if (slab == cls->spare)
+        cls->spare = NULL;
+
+    // lowest free object
+    int w = 0;
+    while (!~slab->used[w])
+        w++;
+    int k = w * 64 + __builtin_ctzll(~slab->used[w]);
+    slab->used[w] |= 1ull << (k % 64);
+
+    if (--slab->nfree == 0)
+        slab_unlink(cls, slab);
+    slab_objects++;
+    pthread_mutex_unlock(&slab_lock);
+
+    return V2VA(slab->base + (vaddr_t)k * slab->size);
+}
+
+// Return: 0 if vaddr was a slab object, -1 if it is not on a slab page.
+static int slab_free(vaddr_t vaddr)
+{
+    pthread_mutex_lock(&slab_lock);
+    struct slab **entry = slab_entry(vaddr, false);
+    struct slab *slab = entry ? *entry : NULL;
+    if (!slab)
+    {
+        pthread_mutex_unlock(&slab_lock);
         return -1;
+    }
 
+    // an interior pointer is not an object: ignore it like a double free
+    // (-1 would make n_free unmap the whole slab page)
+    if ((vaddr - slab->base) % slab->size)
+    {
+        pthread_mutex_unlock(&slab_lock);
+        return 0;
+    }
+    uint32_t k = (vaddr - slab->base) / slab->size;
+    if (!(slab->used[k / 64] & (1ull << (k % 64))))
+    {
+        pthread_mutex_unlock(&slab_lock);
+        return 0;   // already free
+    }
+    slab->used[k / 64] &= ~(1ull << (k % 64));
+    slab_objects--;
+
+    struct slab_class *cls = &slab_classes[__builtin_ctz(slab->size / SLAB_MIN)];
+    if (slab->nfree++ == 0)
+        slab_push(cls, slab);
+
+    // keep one empty slab per class, give the page of any other back
+    if (slab->nfree == PGSIZE / slab->size && slab != cls->spare)
+    {
+        if (!cls->spare)
+            cls->spare = slab;
+        else
+        {
+            slab_unlink(cls, slab);
+            *entry = NULL;
+            slab_pages--;
+            unmap_pages(slab->base, 1);
+            free(slab);
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+    return 0;
+}
+
+void *n_malloc(unsigned int num_bytes)
+{
     ensure_vm_init();
 
-    uintptr_t offset = 0;
-    while (offset < (uintptr_t)size)
+    if (num_bytes == 0)
+        return NULL;
+    // objects up to half a page (the largest class)
+    if (num_bytes <= SLAB_MAX && num_bytes <= PGSIZE / 2)
+        return slab_alloc(num_bytes);
+    return page_alloc(num_bytes);
+}
+
+void n_free(void *va, int size)
+{
+    if (!va || size <= 0)
+        return;
+
+    ensure_vm_init();
+
+    if (slab_free(VA2V(va)) == 0)
+        return;
+    unmap_pages(VA2V(va), (size + PGSIZE - 1) / PGSIZE);
+}
+
+// -----------------------------------------------------------------------------
+// Data Movement
+// -----------------------------------------------------------------------------
+// The page a copy is working on. While one is held the thread stays
+// active, so the page cannot be evicted under it; moving to another page
+// translates once and copies every run on it without translating again.
+struct page_cursor {
+    vaddr_t vpn;
+    uint8_t *base;    // NULL when no page is held
+};
+
+static inline void cursor_release(struct page_cursor *cur)
+{
+    if (cur->base)
+        access_end();
+    cur->base = NULL;
+}
+
+static inline uint8_t *cursor_page(struct page_cursor *cur, vaddr_t vaddr)
+{
+    if (cur->base && cur->vpn == vaddr >> PFN_SHIFT)
+        return cur->base;
+
+    cursor_release(cur);
+    access_begin();
+    cur->base = (uint8_t *)translate(pgdir, V2VA(vaddr));
+    if (!cur->base)
     {
-        vaddr32_t curr_va32 = VA2U(va) + (vaddr32_t)offset;
-        void *curr_va = U2VA(curr_va32);
+        access_end();
+        return NULL;
+    }
+    cur->vpn = vaddr >> PFN_SHIFT;
+    return cur->base;
+}
 
-     
-        void *page_base = (void *)translate(pgdir, curr_va);
+// copy len bytes between buf and the VA range at vaddr, page by page
+static inline int copy_run(struct page_cursor *cur, vaddr_t vaddr, uint8_t *buf, size_t len, bool store)
+{
+    while (len > 0)
+    {
+        uint8_t *page_base = cursor_page(cur, vaddr);
         if (!page_base)
             return -1;
 
-        uintptr_t page_off   = curr_va32 & OFFMASK;
-        int bytes_in_page    = (int)(PGSIZE - page_off);
-        int remaining        = (int)size - (int)offset;
-        int bytes_to_copy    = (remaining < bytes_in_page) ? remaining : bytes_in_page;
+        uintptr_t page_off = vaddr & OFFMASK;
+        size_t bytes_to_copy = PGSIZE - page_off < len ? PGSIZE - page_off : len;
+        if (store)
+            memcpy(page_base + page_off, buf, bytes_to_copy);
+        else
+            memcpy(buf, page_base + page_off, bytes_to_copy);
 
-        memcpy((uint8_t *)page_base + page_off,
-               (uint8_t *)val + offset,
-               bytes_to_copy);
-
-        offset += (uintptr_t)bytes_to_copy;
+        vaddr += bytes_to_copy;
+        buf += bytes_to_copy;
+        len -= bytes_to_copy;
     }
     return 0;
 }
 
+static int copy_vec(const struct vm_iovec *iov, int count, bool store)
+{
+    if (!iov || count < 0)
+        return -1;
+    ensure_vm_init();
+
+    struct page_cursor cur = {0, NULL};
+    int rc = 0;
+    for (int i = 0; i < count && rc == 0; i++)
+    {
+        if (!iov[i].va || !iov[i].buf || iov[i].len < 0)
+            rc = -1;
+        else
+            rc = copy_run(&cur, VA2V(iov[i].va), iov[i].buf, iov[i].len, store);
+    }
+    cursor_release(&cur);
+    return rc;
+}
+
+static int copy_strided(void *va, long stride, void *buf, int elem_size, int count, bool store)
+{
+    if (!va || !buf || elem_size <= 0 || count < 0)
+        return -1;
+    ensure_vm_init();
+
+    // elements next to each other are one run (in size_t: elem_size * count
+    // can pass INT_MAX)
+    size_t run = elem_size;
+    if (stride == elem_size)
+    {
+        run *= (size_t)count;
+        count = count > 0;
+    }
+
+    struct page_cursor cur = {0, NULL};
+    int rc = 0;
+    for (int i = 0; i < count && rc == 0; i++)
+        rc = copy_run(&cur, VA2V(va) + (vaddr_t)((long)i * stride),
+                      (uint8_t *)buf + (size_t)i * run, run, store);
+    cursor_release(&cur);
+    return rc;
+}
+
+int put_data(void *va, void *val, int size)
+{
+    if (!va || !val || size <= 0)
+        return -1;
+    ensure_vm_init();
+
+    struct page_cursor cur = {0, NULL};
+    int rc = copy_run(&cur, VA2V(va), val, size, true);
+    cursor_release(&cur);
+    return rc;
+}
+
 void get_data(void *va, void *val, int size)
 {
     if (!va || !val || size <= 0)
         return;
-
     ensure_vm_init();
 
-    uintptr_t offset = 0;
-    while (offset < (uintptr_t)size)
-    {
-        vaddr32_t curr_va32 = VA2U(va) + (vaddr32_t)offset;
-        void *curr_va = U2VA(curr_va32);
+    struct page_cursor cur = {0, NULL};
+    copy_run(&cur, VA2V(va), val, size, false);
+    cursor_release(&cur);
+}
 
-        void *page_base = (void *)translate(pgdir, curr_va);
-        if (!page_base)
-            return;
+int put_data_vec(const struct vm_iovec *iov, int count)
+{
+    return copy_vec(iov, count, true);
+}
 
-        uintptr_t page_off   = curr_va32 & OFFMASK;
-        int bytes_in_page    = (int)(PGSIZE - page_off);
-        int remaining        = (int)size - (int)offset;
-        int bytes_to_copy    = (remaining < bytes_in_page) ? remaining : bytes_in_page;
+int get_data_vec(const struct vm_iovec *iov, int count)
+{
+    return copy_vec(iov, count, false);
+}
 
-        memcpy((uint8_t *)val + offset,
-               (uint8_t *)page_base + page_off,
-               bytes_to_copy);
+int put_data_strided(void *va, long stride, const void *val, int elem_size, int count)
+{
+    return copy_strided(va, stride, (void *)val, elem_size, count, true);
+}
 
-        offset += (uintptr_t)bytes_to_copy;
-    }
+int get_data_strided(void *va, long stride, void *val, int elem_size, int count)
+{
+    return copy_strided(va, stride, val, elem_size, count, false);
 }
 
-// -----------------------------------------------------------------------------
-// Matrix Multiplication
-// -----------------------------------------------------------------------------
+// answer[i][j] = mat1 row i . mat2 column j. Rows are read and written
+// whole; a column is one strided read, with each page translated once for
+// the elements on it.
 void mat_mult(void *mat1, void *mat2, int size, void *answer)
 {
+    if (size <= 0)
+        return;
+
+    int *a_row = malloc(sizeof(int) * size);
+    int *b_col = malloc(sizeof(int) * size);
+    int *c_row = malloc(sizeof(int) * size);
+    if (!a_row || !b_col || !c_row)
+    {
+        free(a_row);
+        free(b_col);
+        free(c_row);
+        return;
+    }
+
+    long row_bytes = (long)size * sizeof(int);
     for (int i = 0; i < size; i++)
     {
+        get_data(V2VA(VA2V(mat1) + (vaddr_t)i * row_bytes), a_row, row_bytes);
+
         for (int j = 0; j < size; j++)
         {
-            int c_val = 0;
+            get_data_strided(V2VA(VA2V(mat2) + (vaddr_t)j * sizeof(int)), row_bytes,
+                             b_col, sizeof(int), size);
+            int sum = 0;
             for (int k = 0; k < size; k++)
-            {
-                int a = 0, b = 0;
-
-                vaddr32_t a_va32 =
-                    VA2U(mat1) + (vaddr32_t)((i * size + k) * (int)sizeof(int));
-                vaddr32_t b_va32 =
-                    VA2U(mat2) + (vaddr32_t)((k * size + j) * (int)sizeof(int));
-
-                get_data(U2VA(a_va32), &a, sizeof(int));
-                get_data(U2VA(b_va32), &b, sizeof(int));
-
-                c_val += a * b;
-            }
-
-            vaddr32_t c_va32 =
-                VA2U(answer) + (vaddr32_t)((i * size + j) * (int)sizeof(int));
-            put_data(U2VA(c_va32), &c_val, sizeof(int));
+                sum += a_row[k] * b_col[k];
+            c_row[j] = sum;
         }
+
+        put_data(V2VA(VA2V(answer) + (vaddr_t)i * row_bytes), c_row, row_bytes);
     }
+
+    free(a_row);
+    free(b_col);
+    free(c_row);
 }
@@ -16,7 +16,8 @@
  *  Virtual Memory Simulation Header
  * ============================================================================
  *  This header defines constants, data types, and function prototypes
- *  for implementing a simulated 32-bit virtual memory system.
+ *  for implementing a simulated virtual memory system (32-bit by default,
+ *  up to 4-level 48-bit, see PT_LEVELS).
  *
  *  Students will:
  *   - Fill in missing constants and macros for address translation.
@@ -34,33 +35,84 @@
 //  Memory and Paging Configuration
 // -----------------------------------------------------------------------------
 
-#define VA_BITS        32u           // Simulated virtual address width
 #define PGSIZE         4096u         // Page size = 4 KB
 
-#define MAX_MEMSIZE    (1ULL << 32)  // Max virtual memory = 4 GB
+// Page tables have PT_LEVELS levels of PT_BITS index bits each, so a virtual
+// address is VA_BITS = 12 + PT_LEVELS * PT_BITS wide. The default is the
+// classic 32-bit 10/10/12 split; -DPT_LEVELS=4 -DPT_BITS=9 gives 48 bits.
+#ifndef PT_LEVELS
+#define PT_LEVELS      2
+#endif
+#ifndef PT_BITS
+#define PT_BITS        10
+#endif
+#define VA_BITS        (12 + PT_LEVELS * PT_BITS)   // Simulated virtual address width
+
+#ifndef MEMSIZE
 #define MEMSIZE        (1ULL << 30)  // Simulated physical memory = 1 GB
+#endif
+
+// When physical memory runs out, small data pages are evicted (CLOCK over
+// the accessed bits) to a swap file of SWAP_PAGES pages and paged back in
+// on the next access. 0 disables swapping.
+#ifndef SWAP_PAGES
+#define SWAP_PAGES     (1u << 20)    // 4 GB
+#endif
+
+// Virtual memory n_malloc hands out (the virtual bitmap covers this much).
+// All of it for 32-bit addresses, capped at 64 GB for wider ones.
+#ifndef MAX_MEMSIZE
+#define MAX_MEMSIZE    (VA_BITS > 36 ? (1ULL << 36) : (1ULL << VA_BITS))
+#endif
 
 
 //COMPLETE HERE
 
 // --- Constants for bit shifts and masks ---
-#define PDXSHIFT 22  /** TODO: number of bits to shift for directory index **/
-#define PTXSHIFT 12     /** TODO: number of bits to shift for table index **/
-#define PXMASK 0x3FF       /** TODO:  **/
-#define OFFMASK 0xFFF       /** TODO: **/
+#define PT_ENTRIES (1u << PT_BITS)      /* entries per page table */
+#define PXMASK (PT_ENTRIES - 1)
+#define OFFMASK 0xFFF       /* offset within a page */
+#define VA_MASK (VA_BITS >= 64 ? ~0ULL : (1ULL << VA_BITS) - 1)
+
+/* index bits of level l start here; level 0 is the root */
+#define PXSHIFT(l) (PFN_SHIFT + (PT_LEVELS - 1 - (l)) * PT_BITS)
 
 // --- Macros to extract address components ---
-#define PDX(va) (((uint32_t)(va) >> PDXSHIFT) & PXMASK) /** TODO: compute directory index from virtual address **/
-#define PTX(va) (((uint32_t)(va) >> PTXSHIFT) & PXMASK) /** TODO: compute table index from virtual address **/
-#define OFF(va) ((uint32_t)(va) & OFFMASK) /** TODO: compute page offset from virtual address **/
+#define PX(l, va) ((uint32_t)((uint64_t)(va) >> PXSHIFT(l)) & PXMASK) /* table index at level l */
+#define OFF(va) ((uint32_t)(va) & OFFMASK) /* offset within the page */
+
+// A large page is a leaf entry one level above the last: it maps PT_ENTRIES
+// contiguous frames (4 MB by default). n_malloc uses large pages for the
+// aligned 4 MB chunks of allocations that big.
+#define LARGE_PGSIZE ((uint64_t)PGSIZE << PT_BITS)
+
+// With DEMAND_PAGING set, n_malloc only reserves virtual pages; the first
+// access to a page faults in a zeroed frame (or a large page, for the 4 MB
+// chunks of big allocations).
+#ifndef DEMAND_PAGING
+#define DEMAND_PAGING 0
+#endif
+
+// n_malloc requests up to SLAB_MAX bytes are packed into shared pages,
+// in power-of-two size classes from 16 bytes. 0 gives every request its
+// own pages.
+#ifndef SLAB_MAX
+#define SLAB_MAX (PGSIZE / 2)
+#endif
+
+#if PT_BITS > 10 || VA_BITS < 32 || VA_BITS > 64
+#error "need PT_BITS <= 10 (a table fills at most a page) and 32 <= VA_BITS <= 64"
+#endif
+
 // -----------------------------------------------------------------------------
 //  Type Definitions
 // -----------------------------------------------------------------------------
 
+typedef uint64_t vaddr_t;     // Simulated virtual address, VA_BITS wide
 typedef uint32_t vaddr32_t;   // Simulated 32-bit virtual address
 typedef uint32_t paddr32_t;   // Simulated 32-bit physical address
 typedef uint32_t pte_t;       // Page table entry
-typedef uint32_t pde_t;       // Page directory entry
+typedef uint32_t pde_t;       // Page directory entry (any non-leaf level)
 
 // -----------------------------------------------------------------------------
 //  Page Table Flags (Students fill as needed)
@@ -75,31 +127,56 @@ typedef uint32_t pde_t;       // Page directory entry
 static inline vaddr32_t VA2U(void *va)     { return (vaddr32_t)(uintptr_t)va; }
 static inline void*     U2VA(vaddr32_t u)  { return (void*)(uintptr_t)u; }
 
+// Full-width versions; VA2U/U2VA only hold addresses below 4 GB
+static inline vaddr_t   VA2V(void *va)     { return (vaddr_t)(uintptr_t)va & VA_MASK; }
+static inline void*     V2VA(vaddr_t v)    { return (void*)(uintptr_t)v; }
+
 // -----------------------------------------------------------------------------
 //  TLB Configuration
 // -----------------------------------------------------------------------------
 
+#ifndef TLB_ENTRIES
 #define TLB_ENTRIES   512   // Default number of TLB entries
+#endif
+
+// The TLB is set-associative: a VPN hashes to one set of TLB_WAYS entries and
+// only that set is searched. Both must be powers of two, TLB_WAYS <= 32.
+#ifndef TLB_WAYS
+#define TLB_WAYS      8     // Entries per set
+#endif
+#define TLB_SETS      (TLB_ENTRIES / TLB_WAYS)
+
+// Large pages have their own, smaller TLB with the same associativity.
+#ifndef TLB_LARGE_ENTRIES
+#define TLB_LARGE_ENTRIES 32
+#endif
+#define TLB_LARGE_SETS (TLB_LARGE_ENTRIES / TLB_WAYS)
+
+#if (TLB_WAYS & (TLB_WAYS - 1)) || (TLB_SETS & (TLB_SETS - 1)) || TLB_WAYS > 32 \
+    || TLB_LARGE_SETS < 1 || (TLB_LARGE_SETS & (TLB_LARGE_SETS - 1))
+#error "TLB_WAYS and both TLBs' set counts must be powers of two and TLB_WAYS <= 32"
+#endif
 
 struct tlb {
-    /*
-     * TODO: Define the TLB structure.
-     * Each entry typically includes:
-     *  - Virtual Page Number (VPN)
-     *  - Physical Frame Number (PFN)
-     *  - Valid bit
-     *  - Optional timestamp for replacement policy (e.g., LRU)
-     *
-     * Example:
-     *   uint32_t vpn;
-     *   uint32_t pfn;
-     *   bool valid;
-     *   uint64_t last_used;
-     */
-    uint32_t vpn;
+    vaddr_t vpn;
     uint32_t pfn; 
     bool valid;
-    uint64_t last_used;
+};
+
+// Every thread has its own TLB, so hits take no lock. Unmapping pages logs a
+// shootdown that the other threads apply on their next lookup; a thread that
+// fell more than TLB_SHOOTDOWN_LOG shootdowns behind flushes its whole TLB.
+#ifndef TLB_SHOOTDOWN_LOG
+#define TLB_SHOOTDOWN_LOG 64
+#endif
+
+/*
+ * One TLB set. plru holds the tree pseudo-LRU bits: node n (1..TLB_WAYS-1)
+ * points to the half of its subtree that was used less recently.
+ */
+struct tlb_set {
+    struct tlb way[TLB_WAYS];
+    uint32_t plru;
 };
 
 
@@ -128,7 +205,9 @@ int TLB_add(void *va, void *pa);
 pte_t *TLB_check(void *va);
 
 /*
- * Calculates and prints the TLB miss rate.
+ * Calculates and prints the TLB miss rate (over all threads), the hits on
+ * small and large pages, the shootdown counts, the page faults and the
+ * swap traffic.
  * Return: None.
  */
 void print_TLB_missrate(void);
@@ -140,7 +219,8 @@ void print_TLB_missrate(void);
 pte_t* translate(pde_t *pgdir, void *va);
 
 /*
- * Creates a mapping between a virtual and a physical page.
+ * Creates a mapping between a virtual and a physical page, allocating the
+ * intermediate page tables of all PT_LEVELS levels as needed.
  * Return: 0 on success, -1 on failure.
  */
 int map_page(pde_t *pgdir, void *va, void *pa);
@@ -158,7 +238,8 @@ void *get_next_avail(int num_pages);
 void *n_malloc(unsigned int num_bytes);
 
 /*
- * Frees one or more pages of memory starting from the given virtual address.
+ * Frees one or more pages of memory starting from the given virtual address,
+ * or the small object at it if n_malloc packed it into a shared page.
  * Return: None.
  */
 void n_free(void *va, int size);
@@ -176,9 +257,36 @@ int put_data(void *va, void *val, int size);
  */
 void get_data(void *va, void *val, int size);
 
+/*
+ * One piece of a vectored copy: len bytes between buf and the virtual
+ * address va.
+ */
+struct vm_iovec {
+    void *va;
+    void *buf;
+    int len;
+};
+
+/*
+ * Copy every piece of iov in order. Each page is translated once for a run
+ * of pieces on it, rather than once per piece.
+ * Return: 0 on success, -1 on failure (pieces before it were copied).
+ */
+int put_data_vec(const struct vm_iovec *iov, int count);
+int get_data_vec(const struct vm_iovec *iov, int count);
+
+/*
+ * Copy count elements of elem_size bytes between the packed buffer val and
+ * the virtual addresses va, va + stride, va + 2 * stride, ...
+ * Return: 0 on success, -1 on failure.
+ */
+int put_data_strided(void *va, long stride, const void *val, int elem_size, int count);
+int get_data_strided(void *va, long stride, void *val, int elem_size, int count);
+
 /*
  * Performs matrix multiplication using data stored in simulated memory.
- * Each element should be accessed via get_data() and stored via put_data().
+ * Rows of mat1 are read with get_data(), columns of mat2 with
+ * get_data_strided(), and rows of answer are written with put_data().
  * Return: None.
  */
 void mat_mult(void *mat1, void *mat2, int size, void *answer);